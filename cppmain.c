@@ -1,21 +1,43 @@
 #include "preproc.h"
 #include <string.h>
+#include <stdlib.h>
 #include <unistd.h>
 
 static int usage(char *a0) {
 	fprintf(stderr,
 			"example preprocessor\n"
-			"usage: %s [-I includedir...] [-D define] file\n"
+			"usage: %s [-I includedir...] [-D define] [-j threads] [-s] file\n"
 			"if no filename or '-' is passed, stdin is used.\n"
+			"-j lexes large files ahead on the given number of threads.\n"
+			"-s prints statistics to stderr when done.\n"
 			, a0);
 	return 1;
 }
 
+static void print_stats(struct cpp *cpp) {
+	struct cpp_stats st;
+	cpp_get_stats(cpp, &st);
+	fprintf(stderr,
+		"macros: %zu defined, %zu names in %zu slots (load %.3f)\n"
+		"probes: %zu collisions, %.3f avg, %zu max; %zu lookups, %.3f slots each\n"
+		"memory: %zu bytes, %zu distinct bodies\n"
+		"memo: %zu expansions replayed, %zu expanded\n"
+		"conditions: %zu results reused, %zu evaluated; %zu blocks jumped over\n"
+		"includes: %zu skipped by their guard\n",
+		st.macros, st.names, st.slots, st.load_factor,
+		st.collisions, st.avg_probe, st.max_probe,
+		st.lookups, st.lookups ? (double) st.probes / st.lookups : 0.0,
+		st.bytes, st.bodies, st.memo_hits, st.memo_misses,
+		st.cond_hits, st.cond_misses, st.cond_jumps, st.guard_skips);
+}
+
 int main(int argc, char** argv) {
-	int c; char* tmp;
+	int c, stats = 0; char* tmp;
 	struct cpp* cpp = cpp_new();
-	while ((c = getopt(argc, argv, "D:I:")) != EOF) switch(c) {
+	while ((c = getopt(argc, argv, "D:I:j:s")) != EOF) switch(c) {
 	case 'I': cpp_add_includedir(cpp, optarg); break;
+	case 's': stats = 1; break;
+	case 'j': cpp_set_lex_threads(cpp, atoi(optarg)); break;
 	case 'D':
 		if((tmp = strchr(optarg, '='))) *tmp = ' ';
 		cpp_add_define(cpp, optarg);
@@ -33,6 +55,7 @@ int main(int argc, char** argv) {
 		}
 	}
 	int ret = cpp_run(cpp, in, stdout, fn);
+	if(stats) print_stats(cpp);
 	cpp_free(cpp);
 	if(in != stdin) fclose(in);
 	return !ret;
@@ -1,10 +1,12 @@
 #include <string.h>
 #include <ctype.h>
 #include <assert.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <sys/stat.h>
 #include "preproc.h"
 #include "tokenizer.h"
 #include "tglist.h"
-#include "hbmap.h"
 
 #define MACRO_FLAG_OBJECTLIKE (1U<<31)
 #define MACRO_FLAG_VARIADIC (1U<<30)
@@ -15,30 +17,201 @@
 #define MACRO_ARGCOUNT(M) (M->num_args & MACRO_ARGCOUNT_MASK)
 #define MACRO_VARIADIC(M) (M->num_args & MACRO_FLAG_VARIADIC)
 
-#define MAX_RECURSION 32
+/* macros implemented by the preprocessor itself */
+enum builtin {
+	BI_NONE = 0,
+	BI_DEFINED,
+	BI_FILE,
+	BI_LINE,
+};
 
-static unsigned string_hash(const char* s) {
-	uint_fast32_t h = 0;
-	while (*s) {
-		h = 16*h + *s++;
-		h ^= h>>24 & 0xf0;
-	}
-	return h & 0xfffffff;
-}
+enum directive {
+	DIR_NONE = 0,
+	DIR_INCLUDE,
+	DIR_ERROR,
+	DIR_WARNING,
+	DIR_DEFINE,
+	DIR_UNDEF,
+	DIR_IF,
+	DIR_ELIF,
+	DIR_ELSE,
+	DIR_IFDEF,
+	DIR_IFNDEF,
+	DIR_ENDIF,
+	DIR_LINE,
+	DIR_PRAGMA,
+	DIR_MAX = DIR_PRAGMA
+};
+
+static const char *directive_names[DIR_MAX + 1] = {
+	[DIR_INCLUDE] = "include", [DIR_ERROR] = "error", [DIR_WARNING] = "warning",
+	[DIR_DEFINE] = "define", [DIR_UNDEF] = "undef", [DIR_IF] = "if",
+	[DIR_ELIF] = "elif", [DIR_ELSE] = "else", [DIR_IFDEF] = "ifdef",
+	[DIR_IFNDEF] = "ifndef", [DIR_ENDIF] = "endif", [DIR_LINE] = "line",
+	[DIR_PRAGMA] = "pragma",
+};
+
+/* those an inactive block is scanned for */
+static const char *const cond_directive_names[] = {
+	"if", "ifdef", "ifndef", "elif", "else", "endif", 0
+};
+
+/* an interned identifier. there's one atom per distinct name, so names
+   compare equal iff their atoms do. it holds the macro currently
+   defined by that name, if any. */
+struct atom {
+	struct macro *macro;
+	unsigned hash;	/* tokenizer_hash() of the name */
+	unsigned gen;	/* bumped whenever the macro is (re|un)defined */
+	unsigned char builtin;
+	unsigned char directive;
+	unsigned memo_mark;	/* recorded as a dependency, see memo_dep() */
+	unsigned cond_mark;	/* likewise, see cond_dep() */
+	size_t len;
+	char name[];
+};
+
+/* an element of a macro's substitution template */
+enum macro_op {
+	MO_TOKEN = 0,	/* body token, copied as is */
+	MO_ARG,		/* argument in slot, macro-expanded */
+	MO_RAWARG,	/* argument in slot as written, an operand of ## */
+	MO_STRINGIFY,	/* #argument */
+	MO_ERROR,	/* expansion fails here, with message err (if any) */
+};
+
+/* the operand is glued to whatever precedes it (it followed ##) */
+#define MTF_PASTE 1
+
+struct mtok {
+	struct token tok;	/* spelling points into the macro's body text */
+	unsigned char op;
+	unsigned char flags;
+	unsigned short slot;
+	unsigned spaces;	/* blanks emitted before the element */
+	struct atom *atom;	/* of an identifier */
+	const char *err;
+};
+
+/* a macro definition apart from its name and kind. identical ones are
+   shared: of the thousands of macros defined as 1 or 0, all the object-
+   like ones use the same body. bodies live in the arena. */
+struct mbody {
+	unsigned hash;
+	unsigned nparams;
+	/* the variadic parameter is named __VA_ARGS__ */
+	struct atom **params;
+	/* the rest of the line of the #define, as it was read. it is only
+	   lexed into str_contents_buf and compiled once a macro using it is
+	   needed, see macro_prepare(). */
+	const char *raw;
+	size_t raw_len;
+	int prepared;
+	char *str_contents_buf;
+	/* the compiled template. the spellings of its tokens are kept
+	   NUL-terminated in the arena as well. */
+	struct mtok *ops;
+	unsigned nops;
+	unsigned trailing_spaces;
+	/* the template is a single operand of an #if, see name_closed() */
+	int closed;
+};
 
 struct macro {
 	unsigned num_args;
-	FILE* str_contents;
-	char *str_contents_buf;
-	tglist(char*) argnames;
+	union {
+		struct mbody *body;	/* 0 if there's none */
+		struct macro *next_free;	/* once undefined */
+	};
+	struct memo *memo;
+	/* its expansions recorded, and replayed */
+	unsigned memo_misses, memo_hits;
 };
 
+/* names and macros stay until the cpp is freed. they're carved out of
+   large chunks rather than allocated one by one. */
+struct arena {
+	struct arena *next;
+	size_t used, size;
+	char data[];
+};
+
+struct context;
+struct frame;
+struct memo;
+struct memo_dep;
+struct cond_memo;
+struct strpool;
+struct hideset;
+
+#define HS_BUCKETS 256
+
 struct cpp {
 	tglist(char*) includedirs;
-	hbmap(char*, struct macro, 128) *macros;
+	/* the interned identifiers, in an open addressing table with
+	   linear probing. the hashes of the slots are kept apart so that
+	   probing only touches the atoms that likely match. a slot is
+	   empty if its hash is 0, atoms hashing to 0 are stored as 1. */
+	unsigned *atom_hash;
+	struct atom **atom_slot;
+	size_t atom_cap, atom_count;
+	/* atom lookups, and the slots they visited */
+	size_t atom_lookups, atom_probes;
+	/* the distinct macro bodies, in an open addressing table as well */
+	struct mbody **body_slot;
+	size_t body_cap, body_count;
+	struct macro *free_macros;
+	struct arena *arena;
+	size_t arena_size;
+	tglist(struct mtok) ops;	/* template being compiled */
+	/* bumped by every #define and #undef */
+	unsigned macro_gen;
 	const char *last_file;
-	int last_line;
-	struct tokenizer *tchain[MAX_RECURSION];
+	/* position of the last top-level expansion, located on demand */
+	struct tokenizer *last_t;
+	off_t last_off;
+	int lex_threads;
+	/* macro expansion state, see expand_run() */
+	struct context *ctx;
+	size_t ctx_count, ctx_alloc;
+	struct frame *frames;
+	size_t frame_count, frame_alloc;
+	int read_ctx;
+	/* the top-level expansion being recorded, see memo_begin() */
+	struct macro *memo_m;
+	size_t memo_start;
+	int memo_ok;
+	tglist(struct memo_dep) memo_deps;
+	/* the arguments of the invocation, spelled out */
+	char *memo_key;
+	size_t memo_key_len, memo_key_cap;
+	size_t memo_hits, memo_misses;
+	unsigned memo_serial;
+	/* the results of #if and #elif, by the file and offset of the
+	   condition, see evaluate_condition() */
+	struct cond_memo **cond_slot;
+	size_t cond_cap, cond_count;
+	const char *cond_file;	/* of the file being read, if read before */
+	unsigned cond_fhash;
+	int cond_rec;
+	unsigned cond_serial;
+	tglist(struct memo_dep) cond_deps;
+	size_t cond_hits, cond_misses;
+	/* where the conditional directives of the files read are, by
+	   the identity of the file, see parse_file() */
+	struct file_index **index_slot;
+	size_t index_cap, index_count;
+	size_t cond_jumps;
+	/* the files included, by their names, see include_file() */
+	struct header **header_slot;
+	size_t header_cap, header_count;
+	size_t guard_skips;
+	struct strpool *pool, *pool_head;	/* chunk in use, first chunk */
+	/* interned hidesets, they live in the pool */
+	struct hideset *hs_table[HS_BUCKETS];
+	int hs_live;
+	const struct macro **hs_tmp;
+	unsigned hs_tmpsize;
 };
 
 static int token_needs_string(struct token *tok) {
@@ -60,58 +233,165 @@ static int token_needs_string(struct token *tok) {
 	}
 }
 
-static void tokenizer_from_file(struct tokenizer *t, FILE* f) {
-	tokenizer_init(t, f, TF_PARSE_STRINGS);
-	tokenizer_set_filename(t, "<macro>");
-	tokenizer_rewind(t);
+#define ARENA_SIZE (64 * 1024)
+#define ARENA_ALIGN 8
+
+static void *arena_alloc(struct cpp *cpp, size_t n) {
+	struct arena *a = cpp->arena;
+	size_t pad = a ? -(uintptr_t) (a->data + a->used) & (ARENA_ALIGN - 1) : 0;
+	if(!a || a->size - a->used < pad + n) {
+		size_t size = n + ARENA_ALIGN > ARENA_SIZE ? n + ARENA_ALIGN : ARENA_SIZE;
+		a = malloc(sizeof *a + size);
+		if(!a) return 0;
+		a->next = cpp->arena;
+		a->used = 0;
+		a->size = size;
+		cpp->arena = a;
+		cpp->arena_size += sizeof *a + size;
+		pad = -(uintptr_t) a->data & (ARENA_ALIGN - 1);
+	}
+	void *ret = a->data + a->used + pad;
+	a->used += pad + n;
+	return ret;
+}
+
+static void *arena_dup(struct cpp *cpp, const void *p, size_t n) {
+	void *ret = arena_alloc(cpp, n);
+	memcpy(ret, p, n);
+	return ret;
+}
+
+static void arena_free(struct cpp *cpp) {
+	struct arena *a, *next;
+	for(a = cpp->arena; a; a = next) {
+		next = a->next;
+		free(a);
+	}
+	cpp->arena = 0;
+}
+
+#define ATOM_SLOT_HASH(H) ((H) ? (H) : 1)
+
+/* keep the table at most half full, so that the lookups of names that
+   aren't in it, the most common ones, stay short as well */
+static void grow_atoms(struct cpp *cpp) {
+	size_t i, j, n = cpp->atom_cap ? cpp->atom_cap * 2 : 1024;
+	unsigned *hash = calloc(n, sizeof *hash);
+	struct atom **slot = malloc(n * sizeof *slot);
+	for(i = 0; i < cpp->atom_cap; ++i) {
+		if(!cpp->atom_hash[i]) continue;
+		for(j = cpp->atom_slot[i]->hash & (n - 1); hash[j]; j = (j + 1) & (n - 1));
+		hash[j] = cpp->atom_hash[i];
+		slot[j] = cpp->atom_slot[i];
+	}
+	free(cpp->atom_hash);
+	free(cpp->atom_slot);
+	cpp->atom_hash = hash;
+	cpp->atom_slot = slot;
+	cpp->atom_cap = n;
+}
+
+/* the atom named by the len bytes at s, whose hash is given. if there's
+   none yet, it is created if create is set. */
+static struct atom *lookup(struct cpp *cpp, const char *s, size_t len, unsigned hash, int create) {
+	struct atom *a;
+	if(2 * cpp->atom_count >= cpp->atom_cap) grow_atoms(cpp);
+	size_t mask = cpp->atom_cap - 1, i = hash & mask;
+	unsigned h = ATOM_SLOT_HASH(hash);
+	++cpp->atom_lookups;
+	for(; cpp->atom_hash[i]; i = (i + 1) & mask) {
+		++cpp->atom_probes;
+		if(cpp->atom_hash[i] == h && (a = cpp->atom_slot[i])->len == len &&
+		   !memcmp(a->name, s, len))
+			return a;
+	}
+	++cpp->atom_probes;
+	if(!create) return 0;
+	a = arena_alloc(cpp, sizeof *a + len + 1);
+	*a = (struct atom) {.len = len, .hash = hash};
+	memcpy(a->name, s, len);
+	a->name[len] = 0;
+	cpp->atom_hash[i] = h;
+	cpp->atom_slot[i] = a;
+	++cpp->atom_count;
+	return a;
+}
+
+static struct atom *intern(struct cpp *cpp, const char *s) {
+	size_t len = strlen(s);
+	return lookup(cpp, s, len, tokenizer_hash(s, len), 1);
 }
 
-static int strptrcmp(const void *a, const void *b) {
-	const char * const *x = a;
-	const char * const *y = b;
-	return strcmp(*x, *y);
+/* the atom of tok, whose hash was computed by the tokenizer if it is
+   an identifier */
+static struct atom *tok_atom(struct cpp *cpp, struct token *tok, int create) {
+	unsigned hash = tok->type == TT_IDENTIFIER ?
+		(unsigned) tok->value : tokenizer_hash(tok->str, tok->len);
+	return lookup(cpp, tok->str, tok->len, hash, create);
 }
 
-static struct macro* get_macro(struct cpp *cpp, const char *name) {
-	return hbmap_get(cpp->macros, name);
+static struct macro *tok_macro(struct cpp *cpp, struct token *tok) {
+	struct atom *a = tok_atom(cpp, tok, 0);
+	return a ? a->macro : 0;
 }
 
-static void add_macro(struct cpp *cpp, const char *name, struct macro*m) {
-	hbmap_insert(cpp->macros, name, *m);
+static void memo_free(struct macro *m);
+static void cond_free(struct cpp *cpp);
+
+static void add_macro(struct cpp *cpp, struct atom *a, unsigned num_args, struct mbody *body) {
+	struct macro *m = a->macro;
+	if(m) memo_free(m);
+	else if((m = cpp->free_macros)) cpp->free_macros = m->next_free;
+	else m = arena_alloc(cpp, sizeof *m);
+	m->num_args = num_args;
+	m->body = body;
+	m->memo = 0;
+	m->memo_misses = m->memo_hits = 0;
+	a->macro = m;
+	++a->gen;
+	++cpp->macro_gen;
 }
 
-static int undef_macro(struct cpp *cpp, const char *name) {
-	hbmap_iter k = hbmap_find(cpp->macros, name);
-	if(k == (hbmap_iter) -1) return 0;
-	struct macro *m = &hbmap_getval(cpp->macros, k);
-	free(hbmap_getkey(cpp->macros, k));
-	if(m->str_contents) fclose(m->str_contents);
-	free(m->str_contents_buf);
-	tglist_free_values(&m->argnames);
-	tglist_free_items(&m->argnames);
-	hbmap_delete(cpp->macros, k);
+static int undef_macro(struct cpp *cpp, struct atom *a) {
+	struct macro *m = a->macro;
+	if(!m) return 0;
+	memo_free(m);
+	m->next_free = cpp->free_macros;
+	cpp->free_macros = m;
+	a->macro = 0;
+	++a->gen;
+	++cpp->macro_gen;
 	return 1;
 }
 
 static void free_macros(struct cpp *cpp) {
-	hbmap_iter i;
-	hbmap_foreach(cpp->macros, i) {
-		while(hbmap_iter_index_valid(cpp->macros, i))
-			undef_macro(cpp, hbmap_getkey(cpp->macros, i));
-	}
-	hbmap_fini(cpp->macros, 1);
-	free(cpp->macros);
+	size_t i;
+	for(i = 0; i < cpp->atom_cap; ++i)
+		if(cpp->atom_hash[i] && cpp->atom_slot[i]->macro)
+			memo_free(cpp->atom_slot[i]->macro);
+	tglist_free_items(&cpp->memo_deps);
+	free(cpp->memo_key);
+	cond_free(cpp);
+	free(cpp->atom_hash);
+	free(cpp->atom_slot);
+	free(cpp->body_slot);
+	tglist_free_items(&cpp->ops);
+	arena_free(cpp);
 }
 
-static void error_or_warning(const char *err, const char* type, struct tokenizer *t, struct token *curr) {
-	unsigned column = curr ? curr->column : t->column;
-	unsigned line  = curr ? curr->line : t->line;
-	dprintf(2, "<%s> %u:%u %s: '%s'\n", t->filename, line, column, type, err);
-	dprintf(2, "%s\n", t->buf);
-	for(int i = 0; i < strlen(t->buf); i++)
+static void diagnostic(const char *err, const char* type, const char *fn, unsigned line, unsigned column, struct token *curr) {
+	dprintf(2, "<%s> %u:%u %s: '%s'\n", fn, line, column, type, err);
+	if(!curr || !curr->str) return;
+	dprintf(2, "%.*s\n", (int) curr->len, curr->str);
+	for(size_t i = 0; i < curr->len; i++)
 		dprintf(2, "^");
 	dprintf(2, "\n");
 }
+static void error_or_warning(const char *err, const char* type, struct tokenizer *t, struct token *curr) {
+	unsigned line, column;
+	tokenizer_locate(t, curr ? curr->offset : tokenizer_ftello(t), &line, &column);
+	diagnostic(err, type, t->filename, line, column, curr);
+}
 static void error(const char *err, struct tokenizer *t, struct token *curr) {
 	error_or_warning(err, "error", t, curr);
 }
@@ -125,10 +405,7 @@ static void emit(FILE *out, const char *s) {
 
 static int x_tokenizer_next_of(struct tokenizer *t, struct token *tok, int fail_unk) {
 	int ret = tokenizer_next(t, tok);
-	if(tok->type == TT_OVERFLOW) {
-		error("max token length of 4095 exceeded!", t, tok);
-		return 0;
-	} else if (fail_unk && ret == 0) {
+	if (fail_unk && ret == 0) {
 		error("tokenizer encountered unknown token", t, tok);
 		return 0;
 	}
@@ -160,22 +437,37 @@ err:
 	}
 	int i = 0;
 	while(values[i]) {
-		if(!strcmp(values[i], t->buf))
+		if(strlen(values[i]) == token->len && !memcmp(values[i], token->str, token->len))
 			return i;
 		++i;
 	}
 	return -1;
 }
 
+/* the directive named by the next token, or -1 */
+static int expect_directive(struct cpp *cpp, struct tokenizer *t, struct token *token) {
+	int ret;
+	do {
+		ret = tokenizer_next(t, token);
+		if(ret == 0 || token->type == TT_EOF) goto err;
+	} while(is_whitespace_token(token));
+
+	if(token->type != TT_IDENTIFIER) {
+err:
+		error("unexpected token", t, token);
+		return -1;
+	}
+	struct atom *a = tok_atom(cpp, token, 0);
+	return a && a->directive ? a->directive : -1;
+}
+
 static int is_char(struct token *tok, int ch) {
 	return tok->type == TT_SEP && tok->value == ch;
 }
 
 static void flush_whitespace(FILE *out, int *ws_count) {
-	while(*ws_count > 0) {
-		emit(out, " ");
-		--(*ws_count);
-	}
+	if(*ws_count > 0) fprintf(out, "%*s", *ws_count, "");
+	*ws_count = 0;
 }
 
 /* skips until the next non-whitespace token (if the current one is one too)*/
@@ -183,7 +475,7 @@ static int eat_whitespace(struct tokenizer *t, struct token *token, int *count)
 	*count = 0;
 	int ret = 1;
 	while (is_whitespace_token(token)) {
-		++(*count);
+		*count += token->len;
 		ret = x_tokenizer_next(t, token);
 		if(!ret) break;
 	}
@@ -198,74 +490,141 @@ static int skip_next_and_ws(struct tokenizer *t, struct token *tok) {
 	return ret;
 }
 
-static void emit_token(FILE* out, struct token *tok, const char* strbuf) {
-	if(tok->type == TT_SEP) {
+static void emit_token(FILE* out, struct token *tok) {
+	if(tok->type == TT_SEP && !is_whitespace_token(tok)) {
 		fprintf(out, "%c", tok->value);
-	} else if(strbuf && token_needs_string(tok)) {
-		fprintf(out, "%s", strbuf);
+	} else if(token_needs_string(tok) || is_whitespace_token(tok)) {
+		fwrite(tok->str, 1, tok->len, out);
 	} else {
-		dprintf(2, "oops, dunno how to handle tt %d (%s)\n", (int) tok->type, strbuf);
+		dprintf(2, "oops, dunno how to handle tt %d (%.*s)\n", (int) tok->type, (int) tok->len, tok->str);
+	}
+}
+
+/* a file included, by its name as spelled in #include: the path it
+   was found at, and if the whole of it is in an #ifndef group, the
+   macro tested and what the file outputs outside of the group. names
+   are looked up the same way wherever they're included, so the name
+   tells the file. */
+struct header {
+	const char *name, *path;	/* in the arena */
+	size_t len;
+	unsigned hash;
+	struct atom *guard;
+	const char *outside;	/* in the arena */
+	size_t outside_len;
+};
+
+static int grow_headers(struct cpp *cpp) {
+	size_t i, j, n = cpp->header_cap ? cpp->header_cap * 2 : 64;
+	struct header **slot = calloc(n, sizeof *slot);
+	if(!slot) return 0;
+	for(i = 0; i < cpp->header_cap; ++i) {
+		struct header *h = cpp->header_slot[i];
+		if(!h) continue;
+		for(j = h->hash & (n - 1); slot[j]; j = (j + 1) & (n - 1));
+		slot[j] = h;
 	}
+	free(cpp->header_slot);
+	cpp->header_slot = slot;
+	cpp->header_cap = n;
+	return 1;
+}
+
+/* the header named name, added if it's new. 0 if out of memory. */
+static struct header *get_header(struct cpp *cpp, const char *name, size_t len) {
+	struct header *h;
+	unsigned hash = tokenizer_hash(name, len);
+	if(2 * cpp->header_count >= cpp->header_cap && !grow_headers(cpp)) return 0;
+	size_t mask = cpp->header_cap - 1, i = hash & mask;
+	for(; (h = cpp->header_slot[i]); i = (i + 1) & mask)
+		if(h->hash == hash && h->len == len && !memcmp(h->name, name, len)) return h;
+	char *p = arena_alloc(cpp, len + 1);
+	if(!p || !(h = calloc(1, sizeof *h))) return 0;
+	memcpy(p, name, len);
+	p[len] = 0;
+	h->name = p;
+	h->len = len;
+	h->hash = hash;
+	++cpp->header_count;
+	return cpp->header_slot[i] = h;
 }
 
-int parse_file(struct cpp* cpp, FILE *f, const char*, FILE *out);
+static void header_free(struct cpp *cpp) {
+	size_t i;
+	for(i = 0; i < cpp->header_cap; ++i) free(cpp->header_slot[i]);
+	free(cpp->header_slot);
+	cpp->header_slot = 0;
+	cpp->header_cap = cpp->header_count = 0;
+}
+
+static int parse_file(struct cpp* cpp, FILE *f, const char*, FILE *out, struct header *h);
 static int include_file(struct cpp* cpp, struct tokenizer *t, FILE* out) {
 	static const char* inc_chars[] = { "\"", "<", 0};
 	static const char* inc_chars_end[] = { "\"", ">", 0};
 	struct token tok;
-	tokenizer_set_flags(t, 0); // disable string tokenization
+	int tflags = tokenizer_get_flags(t);
+	tokenizer_set_flags(t, tflags & ~TF_PARSE_STRINGS); // disable string tokenization
 
 	int inc1sep = expect(t, TT_SEP, inc_chars, &tok);
 	if(inc1sep == -1) {
 		error("expected one of [\"<]", t, &tok);
 		return 0;
 	}
-	int ret = tokenizer_read_until(t, inc_chars_end[inc1sep], 1);
+	struct token name;
+	int ret = tokenizer_read_until(t, inc_chars_end[inc1sep], 1, &name);
 	if(!ret) {
 		error("error parsing filename", t, &tok);
 		return 0;
 	}
+	struct header *h = get_header(cpp, name.str, name.len);
+	if(!h) {
+		error("out of memory", t, &name);
+		return 0;
+	}
+	assert(tokenizer_next(t, &tok) && is_char(&tok, inc_chars_end[inc1sep][0]));
+	tokenizer_set_flags(t, tflags);
+
+	/* a guarded header adds nothing while its guard is defined */
+	if(h->guard && h->guard->macro) {
+		if(h->outside_len) fwrite(h->outside, 1, h->outside_len, out);
+		++cpp->guard_skips;
+		return 1;
+	}
 	// TODO: different path lookup depending on whether " or <
 	size_t i;
-	FILE *f = 0;
-	tglist_foreach(&cpp->includedirs, i) {
+	FILE *f = h->path ? fopen(h->path, "r") : 0;
+	if(!f) tglist_foreach(&cpp->includedirs, i) {
 		char buf[512];
-		snprintf(buf, sizeof buf, "%s/%s", tglist_get(&cpp->includedirs, i), t->buf);
+		snprintf(buf, sizeof buf, "%s/%s", tglist_get(&cpp->includedirs, i), h->name);
 		f = fopen(buf, "r");
-		if(f) break;
+		if(f) {
+			h->path = arena_dup(cpp, buf, strlen(buf) + 1);
+			break;
+		}
 	}
 	if(!f) {
-		dprintf(2, "%s: ", t->buf);
+		dprintf(2, "%s: ", h->name);
 		perror("fopen");
 		return 0;
 	}
-	const char *fn = strdup(t->buf);
-	assert(tokenizer_next(t, &tok) && is_char(&tok, inc_chars_end[inc1sep][0]));
-
-	tokenizer_set_flags(t, TF_PARSE_STRINGS);
-	return parse_file(cpp, f, fn, out);
+	return parse_file(cpp, f, h->name, out, h);
 }
 
 static int emit_error_or_warning(struct tokenizer *t, int is_error) {
 	int ws_count;
 	int ret = tokenizer_skip_chars(t, " \t", &ws_count);
 	if(!ret) return ret;
-	struct token tmp = {.column = t->column, .line = t->line};
-	ret = tokenizer_read_until(t, "\n", 1);
+	struct token tmp = {.offset = tokenizer_ftello(t)};
+	ret = tokenizer_read_until(t, "\n", 1, &tmp);
+	const char *msg = tokenizer_tokstr(t, &tmp);
 	if(is_error) {
-		error(t->buf, t, &tmp);
+		error(msg, t, &tmp);
 		return 0;
 	}
-	warning(t->buf, t, &tmp);
+	warning(msg, t, &tmp);
 	return 1;
 }
 
-static FILE *freopen_r(FILE *f, char **buf, size_t *size) {
-	fflush(f);
-	fclose(f);
-	return fmemopen(*buf, *size, "r");
-}
-
 static int consume_nl_and_ws(struct tokenizer *t, struct token *tok, int expected) {
 	if(!x_tokenizer_next(t, tok)) {
 err:
@@ -286,13 +645,257 @@ err:
 	return consume_nl_and_ws(t, tok, expected);
 }
 
-static int expand_macro(struct cpp *cpp, struct tokenizer *t, FILE* out, const char* name, unsigned rec_level, char *visited[]);
+static size_t macro_arglist_pos(struct mbody *b, struct atom *iden) {
+	size_t i;
+	for(i = 0; i < b->nparams; i++) {
+		if(b->params[i] == iden) return i;
+	}
+	return (size_t) -1;
+}
+
+static void macro_error(const char *err, struct mbody *b, struct token *tok) {
+	const char *buf = b->str_contents_buf, *s, *line_start = buf;
+	unsigned line = 1;
+	for(s = buf; s < buf + tok->offset; ++s)
+		if(*s == '\n') {
+			++line;
+			line_start = s + 1;
+		}
+	diagnostic(err, "error", "<macro>", line, s - line_start, tok);
+}
+
+static void add_mtok(struct cpp *cpp, struct token *tok, struct atom *a, int op, unsigned slot, unsigned *spaces, int *paste, char **sp) {
+	struct mtok mt = {
+		.tok = *tok, .atom = a, .op = op, .slot = slot,
+		.flags = *paste ? MTF_PASTE : 0, .spaces = *spaces };
+	mt.tok.line_start = 0;
+	mt.tok.str = *sp;
+	if(tok->len) memcpy(*sp, tok->str, tok->len);
+	(*sp)[tok->len] = 0;
+	*sp += tok->len + 1;
+	tglist_add(&cpp->ops, mt);
+	*spaces = 0;
+	*paste = 0;
+}
+
+/* whether the template is a literal, a name, or in parentheses. the
+   arguments and names in it are left to name_closed(). */
+static int template_closed(struct mtok *ops, unsigned nops) {
+	unsigned i, parens = 0;
+	if(nops == 1) switch((unsigned) ops->tok.type) {
+		case TT_IDENTIFIER:
+			return ops->op == MO_TOKEN;
+		case TT_SQSTRING_LIT:
+		case TT_HEX_INT_LIT:
+		case TT_OCT_INT_LIT:
+		case TT_DEC_INT_LIT:
+			return 1;
+		default:
+			return 0;
+	}
+	if(!nops || !is_char(&ops->tok, '(')) return 0;
+	for(i = 0; i < nops; ++i) {
+		if(ops[i].op == MO_ERROR || (ops[i].flags & MTF_PASTE)) return 0;
+		if(ops[i].op != MO_TOKEN) continue;
+		if(is_char(&ops[i].tok, '(')) ++parens;
+		else if(is_char(&ops[i].tok, ')') && !--parens && i + 1 < nops) return 0;
+	}
+	return !parens;
+}
+
+/* turn the body text into the substitution template: arguments are
+   resolved to their slots, blanks to counts, and '#'/'##' are applied.
+   malformed uses of '#' only fail once the macro is expanded, so they
+   become an MO_ERROR element at the point where expansion stops. */
+static void compile_macro(struct cpp *cpp, struct mbody *b) {
+	if(!*b->str_contents_buf) return;
+	size_t i, len = strlen(b->str_contents_buf);
+	struct tokenizer t;
+	tokenizer_init_buffer(&t, b->str_contents_buf, len, TF_PARSE_STRINGS|TF_WHITESPACE_RUNS);
+	/* every token takes at most its share of the text plus a NUL */
+	char *spellings = malloc(2 * len + 1), *sp = spellings;
+	struct token tok;
+	unsigned spaces = 0;
+	int hash_count = 0, paste = 0;
+	const char *err;
+	while(1) {
+		tokenizer_next(&t, &tok);
+		if(tok.type == TT_EOF) break;
+		if(tok.type == TT_IDENTIFIER) {
+			struct atom *id = tok_atom(cpp, &tok, 1);
+			size_t arg_nr = macro_arglist_pos(b, id);
+			if(arg_nr != (size_t) -1) {
+				add_mtok(cpp, &tok, 0, hash_count == 1 ? MO_STRINGIFY : paste ? MO_RAWARG : MO_ARG, arg_nr, &spaces, &paste, &sp);
+				hash_count = 0;
+			} else {
+				if(hash_count == 1) {
+		hash_err:
+					err = "'#' is not followed by macro parameter";
+					goto fail;
+				}
+				add_mtok(cpp, &tok, id, MO_TOKEN, 0, &spaces, &paste, &sp);
+			}
+		} else if(is_char(&tok, '#')) {
+			if(hash_count) {
+				goto hash_err;
+			}
+			while(1) {
+				++hash_count;
+				while(tokenizer_peek(&t) == '\n') {
+					tokenizer_next(&t, &tok);
+				}
+				if(tokenizer_peek(&t) == '#') tokenizer_next(&t, &tok);
+				else break;
+			}
+			if(hash_count > 2) {
+				err = "only two '#' characters allowed for macro expansion";
+				goto fail;
+			}
+			/* blanks before '#' are kept, those around '##' dropped */
+			if(hash_count == 2) {
+				spaces = 0;
+				paste = 1;
+				size_t n = tglist_getsize(&cpp->ops);
+				if(n && tglist_get(&cpp->ops, n - 1).op == MO_ARG)
+					tglist_get(&cpp->ops, n - 1).op = MO_RAWARG;
+			}
+			int ws_count;
+			if(!tokenizer_skip_chars(&t, hash_count == 2 ? " \t\n" : " \t", &ws_count)) {
+				/* the body ends in '#' */
+				err = 0;
+				goto fail;
+			}
+		} else if(is_whitespace_token(&tok)) {
+			spaces += tok.len;
+		} else {
+			if(hash_count == 1) goto hash_err;
+			add_mtok(cpp, &tok, 0, MO_TOKEN, 0, &spaces, &paste, &sp);
+		}
+	}
+	b->trailing_spaces = spaces;
+	b->closed = template_closed(cpp->ops.items, tglist_getsize(&cpp->ops));
+	goto out;
+fail:
+	add_mtok(cpp, &tok, 0, MO_ERROR, 0, &spaces, &paste, &sp);
+	tglist_get(&cpp->ops, tglist_getsize(&cpp->ops) - 1).err = err;
+out:
+	tokenizer_fini(&t);
+	/* move the template to the arena, now that its size is known */
+	char *arena_sp = arena_dup(cpp, spellings, sp - spellings);
+	b->nops = tglist_getsize(&cpp->ops);
+	if(b->nops) b->ops = arena_dup(cpp, cpp->ops.items, b->nops * sizeof *b->ops);
+	for(i = 0; i < b->nops; ++i)
+		b->ops[i].tok.str = arena_sp + (b->ops[i].tok.str - spellings);
+	tglist_free_items(&cpp->ops);
+	free(spellings);
+}
+
+/* like emit_token(), into a buffer */
+static char *put_token(char *p, struct token *tok) {
+	if(tok->type == TT_SEP && !is_whitespace_token(tok)) {
+		*p++ = tok->value;
+	} else if(token_needs_string(tok) || is_whitespace_token(tok)) {
+		memcpy(p, tok->str, tok->len);
+		p += tok->len;
+	} else {
+		dprintf(2, "oops, dunno how to handle tt %d (%.*s)\n", (int) tok->type, (int) tok->len, tok->str);
+	}
+	return p;
+}
+
+/* lex the line the #define left raw, the way it'd have been lexed in
+   place, into the body text, and compile that. */
+static void macro_prepare(struct cpp *cpp, struct mbody *b) {
+	if(!b || b->prepared) return;
+	struct tokenizer t;
+	struct token tok;
+	/* the text only ever shrinks: comments are gone already, and the
+	   backslashes of line continuations are dropped */
+	char *buf = malloc(b->raw_len + 1), *p = buf;
+	int backslash_seen = 0;
+	tokenizer_init_buffer(&t, b->raw, b->raw_len, TF_PARSE_STRINGS|TF_WHITESPACE_RUNS);
+	while(1) {
+		/* ignore unknown tokens in macro body */
+		tokenizer_next(&t, &tok);
+		if(tok.type == TT_EOF) break;
+		if (tok.type == TT_SEP) {
+			if(tok.value == '\\')
+				backslash_seen = 1;
+			else {
+				if(tok.value == '\n' && !backslash_seen) break;
+				p = put_token(p, &tok);
+				backslash_seen = 0;
+			}
+		} else {
+			p = put_token(p, &tok);
+		}
+	}
+	*p++ = 0;
+	tokenizer_fini(&t);
+	b->str_contents_buf = arena_dup(cpp, buf, p - buf);
+	free(buf);
+	b->prepared = 1;
+	compile_macro(cpp, b);
+}
+
+/* whether a redefinition has the same body. the same text with the
+   same parameters is the same body, otherwise the bodies need to be
+   lexed to tell. */
+static int same_body(struct cpp *cpp, struct mbody *old, struct mbody *new) {
+	if(old == new) return 1;
+	macro_prepare(cpp, old);
+	macro_prepare(cpp, new);
+	const char *s_old = old ? old->str_contents_buf : "";
+	const char *s_new = new ? new->str_contents_buf : "";
+	return !strcmp(s_old, s_new);
+}
+
+#define BODY_HASH(H, A) (((H) ^ (A)->hash) * 16777619u)
+
+static void grow_bodies(struct cpp *cpp) {
+	size_t i, j, n = cpp->body_cap ? cpp->body_cap * 2 : 256;
+	struct mbody **slot = calloc(n, sizeof *slot);
+	for(i = 0; i < cpp->body_cap; ++i) {
+		struct mbody *b = cpp->body_slot[i];
+		if(!b) continue;
+		for(j = b->hash & (n - 1); slot[j]; j = (j + 1) & (n - 1));
+		slot[j] = b;
+	}
+	free(cpp->body_slot);
+	cpp->body_slot = slot;
+	cpp->body_cap = n;
+}
+
+/* the body of the raw text of a #define with the given parameters,
+   shared by all the macros defined that way */
+static struct mbody *intern_body(struct cpp *cpp, const char *raw, size_t len, struct atom **params, unsigned nparams) {
+	unsigned i, hash = tokenizer_hash(raw, len);
+	struct mbody *b;
+	for(i = 0; i < nparams; ++i) hash = BODY_HASH(hash, params[i]);
+	if(2 * cpp->body_count >= cpp->body_cap) grow_bodies(cpp);
+	size_t mask = cpp->body_cap - 1, j = hash & mask;
+	for(; (b = cpp->body_slot[j]); j = (j + 1) & mask)
+		if(b->hash == hash && b->raw_len == len && b->nparams == nparams &&
+		   !memcmp(b->raw, raw, len) &&
+		   (!nparams || !memcmp(b->params, params, nparams * sizeof *params)))
+			return b;
+	b = arena_alloc(cpp, sizeof *b);
+	*b = (struct mbody) {.hash = hash, .nparams = nparams, .raw_len = len};
+	if(nparams) b->params = arena_dup(cpp, params, nparams * sizeof *params);
+	char *r = arena_alloc(cpp, len + 1);
+	memcpy(r, raw, len);
+	r[len] = 0;
+	b->raw = r;
+	cpp->body_slot[j] = b;
+	++cpp->body_count;
+	return b;
+}
 
 static int parse_macro(struct cpp *cpp, struct tokenizer *t) {
 	int ws_count;
 	int ret = tokenizer_skip_chars(t, " \t", &ws_count);
 	if(!ret) return ret;
-	struct token curr; //tmp = {.column = t->column, .line = t->line};
+	struct token curr;
 	ret = tokenizer_next(t, &curr) && curr.type != TT_EOF;
 	if(!ret) {
 		error("parsing macro name", t, &curr);
@@ -302,22 +905,26 @@ static int parse_macro(struct cpp *cpp, struct tokenizer *t) {
 		error("expected identifier", t, &curr);
 		return 0;
 	}
-	const char* macroname = strdup(t->buf);
+	struct atom *macroname = tok_atom(cpp, &curr, 1);
+	/* kept for diagnostics, the spelling in the window doesn't last */
+	struct token nametok = curr;
+	nametok.str = macroname->name;
 #ifdef DEBUG
-	dprintf(2, "parsing macro %s\n", macroname);
+	dprintf(2, "parsing macro %s\n", macroname->name);
 #endif
 	int redefined = 0;
-	if(get_macro(cpp, macroname)) {
-		if(!strcmp(macroname, "defined")) {
+	if(macroname->macro) {
+		if(macroname->builtin == BI_DEFINED) {
 			error("\"defined\" cannot be used as a macro name", t, &curr);
 			return 0;
 		}
 		redefined = 1;
 	}
 
-	struct macro new = { 0 };
-	unsigned macro_flags = MACRO_FLAG_OBJECTLIKE;
-	tglist_init(&new.argnames);
+	unsigned num_args = 0, macro_flags = MACRO_FLAG_OBJECTLIKE;
+	tglist(struct atom*) params;
+	tglist_init(&params);
+	struct mbody *body = 0;
 
 	ret = x_tokenizer_next(t, &curr) && curr.type != TT_EOF;
 	if(!ret) return ret;
@@ -330,7 +937,7 @@ static int parse_macro(struct cpp *cpp, struct tokenizer *t) {
 			ret = consume_nl_and_ws(t, &curr, expected);
 			if(!ret) {
 				error("unexpected", t, &curr);
-				return ret;
+				goto fail;
 			}
 			expected = 0;
 			if(curr.type == TT_SEP) {
@@ -342,28 +949,31 @@ static int parse_macro(struct cpp *cpp, struct tokenizer *t) {
 					continue;
 				case ')':
 					ret = tokenizer_skip_chars(t, " \t", &ws_count);
-					if(!ret) return ret;
+					if(!ret) goto fail;
 					goto break_loop1;
 				default:
 					error("unexpected character", t, &curr);
-					return 0;
+					ret = 0;
+					goto fail;
 				}
 			} else if(!(curr.type == TT_IDENTIFIER || curr.type == TT_ELLIPSIS)) {
 				error("expected identifier for macro arg", t, &curr);
-				return 0;
+				ret = 0;
+				goto fail;
 			}
 			{
 				if(curr.type == TT_ELLIPSIS) {
 					if(macro_flags & MACRO_FLAG_VARIADIC) {
 						error("\"...\" isn't the last parameter", t, &curr);
-						return 0;
+						ret = 0;
+						goto fail;
 					}
 					macro_flags |= MACRO_FLAG_VARIADIC;
 				}
-				char *tmps = strdup(t->buf);
-				tglist_add(&new.argnames, tmps);
+				tglist_add(&params, curr.type == TT_ELLIPSIS ?
+					intern(cpp, "__VA_ARGS__") : tok_atom(cpp, &curr, 1));
 			}
-			++new.num_args;
+			++num_args;
 		}
 		break_loop1:;
 	} else if(is_whitespace_token(&curr)) {
@@ -374,298 +984,789 @@ static int parse_macro(struct cpp *cpp, struct tokenizer *t) {
 		goto done;
 	}
 
-	struct FILE_container {
-		FILE *f;
-		char *buf;
-		size_t len;
-        } contents;
-	contents.f = open_memstream(&contents.buf, &contents.len);
+	/* most macros are never used, their body is only lexed on demand */
+	tokenizer_read_line(t, &curr);
+	body = intern_body(cpp, curr.str, curr.len, params.items, num_args);
+done:
+	tglist_free_items(&params);
+	if(redefined && !same_body(cpp, macroname->macro->body, body)) {
+		char buf[128];
+		snprintf(buf, sizeof buf, "redefinition of macro %s", macroname->name);
+		warning(buf, t, &nametok);
+	}
+	add_macro(cpp, macroname, num_args | macro_flags, body);
+	return 1;
+fail:
+	tglist_free_items(&params);
+	return ret;
+}
 
-	int backslash_seen = 0;
-	while(1) {
-		/* ignore unknown tokens in macro body */
-		ret = tokenizer_next(t, &curr);
-		if(!ret) return 0;
-		if(curr.type == TT_EOF) break;
-		if (curr.type == TT_SEP) {
-			if(curr.value == '\\')
-				backslash_seen = 1;
-			else {
-				if(curr.value == '\n' && !backslash_seen) break;
-				emit_token(contents.f, &curr, t->buf);
-				backslash_seen = 0;
-			}
+/* everything macro expansion works on is kept here until the top-level
+   expansion is done: the spellings of the tokens, NUL-terminated, the
+   token lists and the hidesets. the chunks are reused from one
+   expansion to the next, so once they are warmed up expanding doesn't
+   allocate anymore. */
+struct strpool {
+	struct strpool *next;
+	size_t used, size;
+	char data[];
+};
+
+#define STRPOOL_SIZE 16384
+/* chunks kept once a large expansion is done */
+#define STRPOOL_KEEP (1024 * 1024)
+
+static char *pool_alloc(struct cpp *cpp, size_t n) {
+	struct strpool *p = cpp->pool;
+	/* keep token lists and hidesets aligned */
+	n = (n + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+	if(!p || p->size - p->used < n) {
+		struct strpool *next = p ? p->next : cpp->pool_head;
+		if(next && next->size >= n) {
+			p = next;
 		} else {
-			emit_token(contents.f, &curr, t->buf);
-		}
-	}
-	new.str_contents = freopen_r(contents.f, &contents.buf, &contents.len);
-	new.str_contents_buf = contents.buf;
-done:
-	if(redefined) {
-		struct macro *old = get_macro(cpp, macroname);
-		char *s_old = old->str_contents_buf ? old->str_contents_buf : "";
-		char *s_new = new.str_contents_buf ? new.str_contents_buf : "";
-		if(strcmp(s_old, s_new)) {
-			char buf[128];
-			sprintf(buf, "redefinition of macro %s", macroname);
-			warning(buf, t, 0);
+			size_t size = n > STRPOOL_SIZE ? n : STRPOOL_SIZE;
+			struct strpool *np = malloc(sizeof *np + size);
+			if(!np) return 0;
+			np->next = next;
+			np->size = size;
+			if(p) p->next = np;
+			else cpp->pool_head = np;
+			p = np;
 		}
+		p->used = 0;
+		cpp->pool = p;
 	}
-	new.num_args |= macro_flags;
-	add_macro(cpp, macroname, &new);
+	char *ret = p->data + p->used;
+	p->used += n;
+	return ret;
+}
+
+/* grow the allocation of size bytes at q to n bytes in place, if it is
+   the last one made and there's room for it */
+static int pool_extend(struct cpp *cpp, void *q, size_t size, size_t n) {
+	struct strpool *p = cpp->pool;
+	n = (n + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+	size = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+	if(!p || (char*) q + size != p->data + p->used || p->size - p->used < n - size)
+		return 0;
+	p->used += n - size;
 	return 1;
 }
 
-static size_t macro_arglist_pos(struct macro *m, const char* iden) {
-	size_t i;
-	for(i = 0; i < tglist_getsize(&m->argnames); i++) {
-		char *item = tglist_get(&m->argnames, i);
-		if(!strcmp(item, iden)) return i;
+static const char *pool_strndup(struct cpp *cpp, const char *s, size_t len) {
+	char *ret = pool_alloc(cpp, len + 1);
+	memcpy(ret, s, len);
+	ret[len] = 0;
+	return ret;
+}
+
+/* release everything at once. the chunks are kept for reuse, as far
+   as they don't add up to more than STRPOOL_KEEP. */
+static void pool_reset(struct cpp *cpp) {
+	struct strpool *p, *next, **link = &cpp->pool_head;
+	size_t kept = 0;
+	if(cpp->hs_live) {
+		memset(cpp->hs_table, 0, sizeof cpp->hs_table);
+		cpp->hs_live = 0;
 	}
-	return (size_t) -1;
+	for(p = cpp->pool_head; p; p = next) {
+		next = p->next;
+		if(kept + p->size <= STRPOOL_KEEP || p == cpp->pool_head) {
+			kept += p->size;
+			link = &p->next;
+		} else {
+			*link = next;
+			free(p);
+		}
+	}
+	cpp->pool = cpp->pool_head;
+	if(cpp->pool) cpp->pool->used = 0;
 }
 
+static void pool_free(struct cpp *cpp) {
+	struct strpool *p, *next;
+	for(p = cpp->pool_head; p; p = next) {
+		next = p->next;
+		free(p);
+	}
+	cpp->pool = cpp->pool_head = 0;
+	free(cpp->hs_tmp);
+}
 
-struct macro_info {
-	const char *name;
-	unsigned nest;
-	unsigned first;
-	unsigned last;
+/* the set of macros a token must not be expanded by anymore, because
+   it resulted from their expansion. sets are immutable and interned,
+   so equal sets are the same pointer. 0 is the empty set. */
+struct hideset {
+	struct hideset *next;	/* in the bucket of hs_table */
+	unsigned hash;
+	unsigned count;
+	const struct macro *items[];	/* ordered by address */
 };
 
-static int was_visited(const char *name, char*visited[], unsigned rec_level) {
-	int x;
-	for(x = rec_level; x >= 0; --x) {
-		if(!strcmp(visited[x], name)) return 1;
-	}
+static int hs_contains(const struct hideset *hs, const struct macro *m) {
+	unsigned i;
+	if(hs) for(i = 0; i < hs->count; ++i)
+		if(hs->items[i] == m) return 1;
 	return 0;
 }
 
-unsigned get_macro_info(struct cpp* cpp,
-	struct tokenizer *t,
-	struct macro_info *mi_list, size_t *mi_cnt,
-	unsigned nest, unsigned tpos, const char *name,
-	char* visited[], unsigned rec_level
-	) {
-	int brace_lvl = 0;
-	while(1) {
-		struct token tok;
-		int ret = tokenizer_next(t, &tok);
-		if(!ret || tok.type == TT_EOF) break;
-#ifdef DEBUG
-		dprintf(2, "(%s) nest %d, brace %u t: %s\n", name, nest, brace_lvl, t->buf);
-#endif
-		struct macro* m = 0;
-		if(tok.type == TT_IDENTIFIER && (m = get_macro(cpp, t->buf)) && !was_visited(t->buf, visited, rec_level)) {
-			const char* newname = strdup(t->buf);
-			if(FUNCTIONLIKE(m)) {
-				if(tokenizer_peek(t) == '(') {
-					unsigned tpos_save = tpos;
-					tpos = get_macro_info(cpp, t, mi_list, mi_cnt, nest+1, tpos+1, newname, visited, rec_level);
-					mi_list[*mi_cnt] = (struct macro_info) {
-						.name = newname,
-						.nest=nest+1,
-						.first = tpos_save,
-						.last = tpos + 1};
-					++(*mi_cnt);
-				} else {
-					/* suppress expansion */
-				}
-			} else {
-				mi_list[*mi_cnt] = (struct macro_info) {
-					.name = newname,
-					.nest=nest+1,
-					.first = tpos,
-					.last = tpos + 1};
-				++(*mi_cnt);
-			}
-		} else if(is_char(&tok, '(')) {
-			++brace_lvl;
-		} else if(is_char(&tok, ')')) {
-			--brace_lvl;
-			if(brace_lvl == 0 && nest != 0) break;
+static const struct hideset *hs_intern(struct cpp *cpp, const struct macro **items, unsigned count) {
+	if(!count) return 0;
+	unsigned i, h = 2166136261u;
+	for(i = 0; i < count; ++i)
+		h = (h ^ (unsigned) ((uintptr_t) items[i] >> 4)) * 16777619u;
+	struct hideset **b = &cpp->hs_table[h % HS_BUCKETS], *hs;
+	for(hs = *b; hs; hs = hs->next)
+		if(hs->hash == h && hs->count == count && !memcmp(hs->items, items, count * sizeof *items))
+			return hs;
+	hs = (void*) pool_alloc(cpp, sizeof *hs + count * sizeof *items);
+	hs->hash = h;
+	hs->count = count;
+	memcpy(hs->items, items, count * sizeof *items);
+	hs->next = *b;
+	*b = hs;
+	cpp->hs_live = 1;
+	return hs;
+}
+
+static const struct macro **hs_buf(struct cpp *cpp, unsigned count) {
+	if(count > cpp->hs_tmpsize) {
+		cpp->hs_tmpsize = count * 2;
+		cpp->hs_tmp = realloc(cpp->hs_tmp, cpp->hs_tmpsize * sizeof *cpp->hs_tmp);
+	}
+	return cpp->hs_tmp;
+}
+
+static const struct hideset *hs_union(struct cpp *cpp, const struct hideset *a, const struct hideset *b) {
+	if(!a || a == b) return b;
+	if(!b) return a;
+	const struct macro **r = hs_buf(cpp, a->count + b->count);
+	unsigned i = 0, j = 0, n = 0;
+	while(i < a->count || j < b->count) {
+		if(j == b->count || (i < a->count && a->items[i] < b->items[j])) r[n++] = a->items[i++];
+		else if(i == a->count || b->items[j] < a->items[i]) r[n++] = b->items[j++];
+		else {
+			r[n++] = a->items[i++];
+			++j;
 		}
-		++tpos;
 	}
-	return tpos;
+	return hs_intern(cpp, r, n);
 }
 
-struct FILE_container {
-	FILE *f;
-	char *buf;
-	size_t len;
-	struct tokenizer t;
-};
+static const struct hideset *hs_intersect(struct cpp *cpp, const struct hideset *a, const struct hideset *b) {
+	if(a == b) return a;
+	if(!a || !b) return 0;
+	const struct macro **r = hs_buf(cpp, a->count < b->count ? a->count : b->count);
+	unsigned i = 0, j = 0, n = 0;
+	while(i < a->count && j < b->count) {
+		if(a->items[i] < b->items[j]) ++i;
+		else if(b->items[j] < a->items[i]) ++j;
+		else {
+			r[n++] = a->items[i++];
+			++j;
+		}
+	}
+	return hs_intern(cpp, r, n);
+}
 
-static void free_file_container(struct FILE_container *fc) {
-	fclose(fc->f);
-	free(fc->buf);
+static const struct hideset *hs_add(struct cpp *cpp, const struct hideset *hs, const struct macro *m) {
+	if(hs_contains(hs, m)) return hs;
+	unsigned i, n = 0, count = hs ? hs->count : 0;
+	const struct macro **r = hs_buf(cpp, count + 1);
+	for(i = 0; i < count && hs->items[i] < m; ++i) r[n++] = hs->items[i];
+	r[n++] = m;
+	for(; i < count; ++i) r[n++] = hs->items[i];
+	return hs_intern(cpp, r, n);
 }
 
-static int mem_tokenizers_join(
-	struct FILE_container* org, struct FILE_container *inj,
-	struct FILE_container* result,
-	int first, off_t lastpos) {
-	result->f = open_memstream(&result->buf, &result->len);
-	size_t i;
+/* a token on its way through macro expansion */
+struct htok {
 	struct token tok;
-	int ret;
-	tokenizer_rewind(&org->t);
-	for(i=0; i<first; ++i) {
-		ret = tokenizer_next(&org->t, &tok);
-		assert(ret && tok.type != TT_EOF);
-		emit_token(result->f, &tok, org->t.buf);
-	}
-	int cnt = 0, last = first;
-	while(1) {
-		ret = tokenizer_next(&inj->t, &tok);
-		if(!ret || tok.type == TT_EOF) break;
-		emit_token(result->f, &tok, inj->t.buf);
-		++cnt;
-	}
-	while(tokenizer_ftello(&org->t) < lastpos) {
-		ret = tokenizer_next(&org->t, &tok);
-		last++;
-	}
+	const struct hideset *hs;
+	struct atom *atom;	/* of an identifier */
+};
 
-	int diff = cnt - ((int) last - (int) first);
+struct toklist {
+	struct htok *items;
+	size_t count, capa;
+};
 
-	while(1) {
-		ret = tokenizer_next(&org->t, &tok);
-		if(!ret || tok.type == TT_EOF) break;
-		emit_token(result->f, &tok, org->t.buf);
+/* token lists live in the pool, they're never freed one by one */
+static void toklist_reserve(struct cpp *cpp, struct toklist *l, size_t count) {
+	if(count <= l->capa) return;
+	size_t capa = l->capa ? l->capa * 2 : 16;
+	if(capa < count) capa = count;
+	if(!l->items || !pool_extend(cpp, l->items, l->capa * sizeof *l->items, capa * sizeof *l->items)) {
+		struct htok *items = (void*) pool_alloc(cpp, capa * sizeof *items);
+		if(l->count) memcpy(items, l->items, l->count * sizeof *items);
+		l->items = items;
 	}
+	l->capa = capa;
+}
 
-	result->f = freopen_r(result->f, &result->buf, &result->len);
-	tokenizer_from_file(&result->t, result->f);
-	return diff;
+static void toklist_push(struct cpp *cpp, struct toklist *l, const struct htok *ht) {
+	if(l->count == l->capa) toklist_reserve(cpp, l, l->count + 1);
+	l->items[l->count++] = *ht;
 }
 
-static int tchain_parens_follows(struct cpp *cpp, int rec_level) {
-	int i, c = 0;
-	for(i=rec_level;i>=0;--i) {
-		c = tokenizer_peek(cpp->tchain[i]);
-		if(c == EOF) continue;
-		if(c == '(') return i;
-		else break;
-	}
-	return -1;
+static void toklist_add(struct cpp *cpp, struct toklist *l, const struct token *tok, const struct hideset *hs) {
+	toklist_push(cpp, l, &(struct htok) {.tok = *tok, .hs = hs});
 }
 
-static int stringify(struct cpp *ccp, struct tokenizer *t, FILE* output) {
-	int ret = 1;
-	struct token tok;
-	emit(output, "\"");
-	while(1) {
-		ret = tokenizer_next(t, &tok);
-		if(!ret) return ret;
-		if(tok.type == TT_EOF) break;
-		if(is_char(&tok, '\n')) continue;
-		if(is_char(&tok, '\\') && tokenizer_peek(t) == '\n') continue;
-		if(tok.type == TT_DQSTRING_LIT) {
-			char *s = t->buf;
-			char buf[2] = {0};
-			while(*s) {
-				if(*s == '\"') {
-					emit(output, "\\\"");
-				} else if (*s == '\\') {
-					emit(output, "\\\\");
-				} else {
-					buf[0] = *s;
-					emit(output, buf);
-				}
-				++s;
-			}
-		} else
-			emit_token(output, &tok, t->buf);
+static void toklist_append(struct cpp *cpp, struct toklist *l, const struct toklist *src) {
+	if(!src->count) return;
+	toklist_reserve(cpp, l, l->count + src->count);
+	memcpy(l->items + l->count, src->items, src->count * sizeof *l->items);
+	l->count += src->count;
+}
+
+/* replace the tokens [first, last) of l by those of ins */
+static void toklist_splice(struct cpp *cpp, struct toklist *l, size_t first, size_t last, const struct toklist *ins) {
+	size_t tail = l->count - last, count = first + ins->count + tail;
+	toklist_reserve(cpp, l, count);
+	memmove(l->items + first + ins->count, l->items + last, tail * sizeof *l->items);
+	memcpy(l->items + first, ins->items, ins->count * sizeof *l->items);
+	l->count = count;
+}
+
+static struct toklist *toklists_new(struct cpp *cpp, unsigned n) {
+	struct toklist *l = (void*) pool_alloc(cpp, n * sizeof *l);
+	memset(l, 0, n * sizeof *l);
+	return l;
+}
+
+static void emit_tokens(FILE *out, struct toklist *l) {
+	size_t i;
+	for(i = 0; i < l->count; ++i)
+		emit_token(out, &l->items[i].tok);
+}
+
+static void add_blanks(struct cpp *cpp, struct toklist *l, unsigned n) {
+	static const char blanks[] = "                                ";
+	while(n) {
+		unsigned len = n < sizeof blanks - 1 ? n : sizeof blanks - 1;
+		toklist_add(cpp, l, &(struct token) {.type = TT_SEP, .value = ' ', .str = blanks, .len = len}, 0);
+		n -= len;
 	}
-	emit(output, "\"");
-	return ret;
 }
 
-/* rec_level -1 serves as a magic value to signal we're using
-   expand_macro from the if-evaluator code, which means activating
-   the "define" macro */
-static int expand_macro(struct cpp* cpp, struct tokenizer *t, FILE* out, const char* name, unsigned rec_level, char* visited[]) {
-	int is_define = !strcmp(name, "defined");
+/* the expansion of a macro, being rescanned. contexts stack up as
+   expansions lead to more expansions. */
+struct context {
+	struct toklist l;
+	size_t pos;
+};
 
+/* an expansion reading from an input, with the contexts from ctx_base
+   on stacked on top of it. the base frame reads the file, whose tokens
+   are only consumed by invocations looking for their arguments. the
+   arguments of an invocation are expanded in a frame of their own,
+   one after the other, before they're substituted. */
+struct frame {
+	struct tokenizer *t;	/* input: a file, or */
+	struct toklist *in;	/* a token list */
+	size_t pos;
+	size_t ctx_base;
+	struct toklist out;
+	/* argument frames: the invocation waiting for its arguments */
 	struct macro *m;
-	if(is_define && rec_level != -1)
-		m = NULL;
-	else m = get_macro(cpp, name);
-	if(!m) {
-		emit(out, name);
-		return 1;
-	}
-	if(rec_level == -1) rec_level = 0;
-	if(rec_level >= MAX_RECURSION) {
-		error("max recursion level reached", t, 0);
-		return 0;
-	}
-#ifdef DEBUG
-	dprintf(2, "lvl %u: expanding macro %s (%s)\n", rec_level, name, m->str_contents_buf);
-#endif
+	const struct hideset *hs;
+	struct toklist *args, *xargs;
+	unsigned nargs, arg;
+};
 
-	if(rec_level == 0 && strcmp(t->filename, "<macro>")) {
-		cpp->last_file = t->filename;
-		cpp->last_line = t->line;
+static void ctx_push(struct cpp *cpp, struct toklist *l) {
+	if(!l->count) return;
+	if(cpp->ctx_count == cpp->ctx_alloc) {
+		cpp->ctx_alloc = cpp->ctx_alloc ? cpp->ctx_alloc * 2 : 16;
+		cpp->ctx = realloc(cpp->ctx, cpp->ctx_alloc * sizeof *cpp->ctx);
 	}
-	if(!strcmp(name, "__FILE__")) {
-		emit(out, "\"");
-		emit(out, cpp->last_file);
-		emit(out, "\"");
+	cpp->ctx[cpp->ctx_count++] = (struct context) {.l = *l};
+}
+
+static void ctx_pop(struct cpp *cpp) {
+	--cpp->ctx_count;
+}
+
+static struct frame *frame_top(struct cpp *cpp) {
+	return &cpp->frames[cpp->frame_count - 1];
+}
+
+static struct frame *frame_push(struct cpp *cpp) {
+	if(cpp->frame_count == cpp->frame_alloc) {
+		cpp->frame_alloc = cpp->frame_alloc ? cpp->frame_alloc * 2 : 8;
+		cpp->frames = realloc(cpp->frames, cpp->frame_alloc * sizeof *cpp->frames);
+	}
+	struct frame *f = &cpp->frames[cpp->frame_count++];
+	*f = (struct frame) {.ctx_base = cpp->ctx_count};
+	return f;
+}
+
+static void frame_pop(struct cpp *cpp) {
+	struct frame *f = frame_top(cpp);
+	while(cpp->ctx_count > f->ctx_base) ctx_pop(cpp);
+	--cpp->frame_count;
+}
+
+/* the top context of the frame that still has tokens, or 0.
+   exhausted ones are only dropped here, so that the one the last
+   token came from is still around for diagnostics. */
+static struct context *ctx_current(struct cpp *cpp) {
+	struct frame *f = frame_top(cpp);
+	while(cpp->ctx_count > f->ctx_base) {
+		struct context *c = &cpp->ctx[cpp->ctx_count - 1];
+		if(c->pos < c->l.count) return c;
+		ctx_pop(cpp);
+	}
+	return 0;
+}
+
+/* next token of the top frame: from its contexts, and once they're
+   exhausted from its input if input is set. returns 0 at the end,
+   -1 if the file can't be read. */
+static int frame_next(struct cpp *cpp, struct htok *ht, int input, int *from_input) {
+	struct frame *f = frame_top(cpp);
+	struct context *c = ctx_current(cpp);
+	*from_input = 0;
+	cpp->read_ctx = !!c;
+	if(c) {
+		*ht = c->l.items[c->pos++];
 		return 1;
-	} else if(!strcmp(name, "__LINE__")) {
-		char buf[64];
-		sprintf(buf, "%d", cpp->last_line);
-		emit(out, buf);
+	}
+	*ht = (struct htok) {.tok.type = TT_EOF};
+	if(!input) return 0;
+	*from_input = 1;
+	if(cpp->frame_count == 1) cpp->memo_ok = 0;
+	if(f->t) {
+		if(!tokenizer_next(f->t, &ht->tok)) return -1;
+		if(ht->tok.type == TT_EOF) return 0;
+		/* names nothing was ever defined by needn't be interned */
+		if(ht->tok.type == TT_IDENTIFIER && (ht->atom = tok_atom(cpp, &ht->tok, 0)))
+			ht->tok.str = ht->atom->name;
+		else if(ht->tok.str)
+			ht->tok.str = pool_strndup(cpp, ht->tok.str, ht->tok.len);
 		return 1;
 	}
+	if(f->pos == f->in->count) return 0;
+	*ht = f->in->items[f->pos++];
+	return 1;
+}
 
-	if(visited[rec_level]) free(visited[rec_level]);
-	visited[rec_level] = strdup(name);
-	cpp->tchain[rec_level] = t;
+/* first character of the next token of the top frame, or EOF */
+static int frame_peek(struct cpp *cpp) {
+	struct frame *f = frame_top(cpp);
+	struct context *c = ctx_current(cpp);
+	if(c) return (unsigned char) c->l.items[c->pos].tok.str[0];
+	if(cpp->frame_count == 1) cpp->memo_ok = 0;
+	if(f->t) return tokenizer_peek(f->t);
+	if(f->pos < f->in->count) return (unsigned char) f->in->items[f->pos].tok.str[0];
+	return EOF;
+}
 
-	size_t i;
+/* skip blanks, returns 0 if the end of the input is reached */
+static int frame_skip_blanks(struct cpp *cpp) {
+	struct frame *f = frame_top(cpp);
+	struct context *c;
+	int ws_count;
+	while((c = ctx_current(cpp))) {
+		if(!is_whitespace_token(&c->l.items[c->pos].tok)) return 1;
+		++c->pos;
+	}
+	if(cpp->frame_count == 1) cpp->memo_ok = 0;
+	if(f->t) return tokenizer_skip_chars(f->t, " \t", &ws_count);
+	while(f->pos < f->in->count && is_whitespace_token(&f->in->items[f->pos].tok))
+		++f->pos;
+	return f->pos < f->in->count;
+}
+
+/* report an error about the token just read. tokens of a list are
+   located in the text the list spells. */
+static void read_error(struct cpp *cpp, const char *err, struct token *tok) {
+	struct frame *f = frame_top(cpp);
+	struct toklist *l;
+	size_t i, end;
+	if(cpp->read_ctx) {
+		struct context *c = &cpp->ctx[cpp->ctx_count - 1];
+		l = &c->l;
+		end = c->pos - 1;
+	} else if(f->t) {
+		error(err, f->t, tok);
+		return;
+	} else {
+		l = f->in;
+		end = f->pos ? f->pos - 1 : 0;
+	}
+	unsigned line = 1, column = 0;
+	for(i = 0; i < end; ++i) {
+		if(is_char(&l->items[i].tok, '\n')) {
+			++line;
+			column = 0;
+		} else
+			column += l->items[i].tok.len;
+	}
+	diagnostic(err, "error", "<macro>", line, column, tok);
+}
+
+static void stringify(struct cpp *cpp, struct toklist *arg, struct toklist *out) {
+	size_t i, len = 2;
+	for(i = 0; i < arg->count; ++i)
+		len += arg->items[i].tok.len * (arg->items[i].tok.type == TT_DQSTRING_LIT ? 2 : 1);
+	char *buf = pool_alloc(cpp, len + 1), *p = buf;
+	*p++ = '"';
+	for(i = 0; i < arg->count; ++i) {
+		struct token *tok = &arg->items[i].tok;
+		if(is_char(tok, '\n')) continue;
+		if(is_char(tok, '\\') && i + 1 < arg->count && is_char(&arg->items[i + 1].tok, '\n')) continue;
+		if(tok->type == TT_DQSTRING_LIT) {
+			const char *s = tok->str, *e = tok->str + tok->len;
+			while(s < e) {
+				if(*s == '\"' || *s == '\\') *p++ = '\\';
+				*p++ = *s++;
+			}
+		} else if(tok->type == TT_SEP && !is_whitespace_token(tok)) {
+			*p++ = tok->value;
+		} else {
+			memcpy(p, tok->str, tok->len);
+			p += tok->len;
+		}
+	}
+	*p++ = '"';
+	*p = 0;
+	toklist_add(cpp, out, &(struct token) {.type = TT_DQSTRING_LIT, .str = buf, .len = p - buf}, 0);
+}
+
+/* glue the tokens at from and from - 1 together and lex the result again */
+static void paste(struct cpp *cpp, struct toklist *l, size_t from) {
+	if(from == 0 || from >= l->count) return;
+	struct token *a = &l->items[from - 1].tok, *b = &l->items[from].tok;
+	size_t len = a->len + b->len;
+	char *buf = pool_alloc(cpp, len + 1);
+	memcpy(buf, a->str, a->len);
+	memcpy(buf + a->len, b->str, b->len);
+	buf[len] = 0;
+	struct tokenizer t;
+	struct toklist res = {0};
 	struct token tok;
-	unsigned num_args = MACRO_ARGCOUNT(m);
-	struct FILE_container *argvalues = calloc(MACRO_VARIADIC(m) ? num_args + 1 : num_args, sizeof(struct FILE_container));
+	tokenizer_init_buffer(&t, buf, len, TF_PARSE_STRINGS);
+	while(tokenizer_next(&t, &tok) && tok.type != TT_EOF) {
+		struct htok ht = {.tok = tok};
+		ht.tok.line_start = 0;
+		if(tok.type == TT_IDENTIFIER && (ht.atom = tok_atom(cpp, &tok, 0)))
+			ht.tok.str = ht.atom->name;
+		else
+			ht.tok.str = pool_strndup(cpp, tok.str, tok.len);
+		toklist_push(cpp, &res, &ht);
+	}
+	tokenizer_fini(&t);
+	toklist_splice(cpp, l, from - 1, from + 1, &res);
+}
+
+/* replace the invocation of m by its body, with the arguments (args
+   as read, xargs macro-expanded) substituted. */
+static int substitute(struct cpp *cpp, struct macro *m, struct toklist *args, struct toklist *xargs, const struct hideset *hs, struct toklist *out) {
+	struct mbody *b = m->body;
+	size_t i;
+	for(i = 0; i < b->nops; ++i) {
+		struct mtok *mt = &b->ops[i];
+		size_t mark = out->count;
+		add_blanks(cpp, out, mt->spaces);
+		switch(mt->op) {
+		case MO_TOKEN:
+			toklist_push(cpp, out, &(struct htok) {.tok = mt->tok, .atom = mt->atom});
+			break;
+		case MO_STRINGIFY:
+			stringify(cpp, &args[mt->slot], out);
+			break;
+		case MO_ARG:
+			toklist_append(cpp, out, &xargs[mt->slot]);
+			break;
+		case MO_RAWARG:
+			toklist_append(cpp, out, &args[mt->slot]);
+			break;
+		case MO_ERROR:
+			if(mt->err) macro_error(mt->err, b, &mt->tok);
+			return 0;
+		}
+		if(mt->flags & MTF_PASTE) paste(cpp, out, mark);
+	}
+	add_blanks(cpp, out, b->trailing_spaces);
+	/* runs of tokens share their hideset */
+	const struct hideset *from = 0, *to = hs;
+	for(i = 0; i < out->count; ++i) {
+		if(out->items[i].hs != from) {
+			from = out->items[i].hs;
+			to = hs_union(cpp, from, hs);
+		}
+		out->items[i].hs = to;
+	}
+	return 1;
+}
+
+/* the next argument of the invocation waiting in f that is substituted
+   macro-expanded, starting with from. returns f->nargs if there's none. */
+static unsigned next_xarg(struct frame *f, unsigned from) {
+	size_t i;
+	unsigned next = f->nargs;
+	struct mbody *b = f->m->body;
+	for(i = 0; i < b->nops; ++i) {
+		struct mtok *mt = &b->ops[i];
+		if(mt->op == MO_ARG && mt->slot >= from && mt->slot < next) next = mt->slot;
+	}
+	return next;
+}
+
+/* the arguments of the invocation are ready, replace it by the body */
+static int finish_invocation(struct cpp *cpp) {
+	struct frame *f = frame_top(cpp);
+	struct toklist res = {0};
+	int ret = substitute(cpp, f->m, f->args, f->xargs, f->hs, &res);
+	frame_pop(cpp);
+	if(ret) ctx_push(cpp, &res);
+	return ret;
+}
+
+/* the result of a top-level expansion of a macro, with the names it
+   looked at. it can be replayed for an invocation with the same
+   arguments as long as none of these names was (re|un)defined since. */
+struct memo_dep {
+	struct atom *atom;
+	unsigned gen;
+};
+
+struct memo {
+	unsigned gen;	/* cpp->macro_gen when it was last found valid */
+	unsigned ndeps;
+	struct toklist l;
+	char *key;	/* followed by the spellings of l */
+	size_t key_len;
+	struct memo_dep deps[];
+};
+
+static void memo_free(struct macro *m) {
+	if(!m->memo) return;
+	free(m->memo->l.items);
+	free(m->memo->key);
+	free(m->memo);
+	m->memo = 0;
+}
+
+/* record that the condition being evaluated read the name a */
+static void cond_dep(struct cpp *cpp, struct atom *a) {
+	if(!cpp->cond_rec || a->cond_mark == cpp->cond_serial) return;
+	a->cond_mark = cpp->cond_serial;
+	tglist_add(&cpp->cond_deps, ((struct memo_dep) {a, a->gen}));
+}
+
+/* spell out the arguments of an invocation as the key of its memo.
+   tokens are separated by NULs, arguments by \1. */
+static void memo_key(struct cpp *cpp, struct toklist *args, unsigned nargs) {
+	size_t i, len = 0;
+	unsigned j;
+	for(j = 0; j < nargs; ++j) {
+		for(i = 0; i < args[j].count; ++i) len += args[j].items[i].tok.len + 1;
+		++len;
+	}
+	if(len > cpp->memo_key_cap) {
+		cpp->memo_key_cap = len * 2;
+		cpp->memo_key = realloc(cpp->memo_key, cpp->memo_key_cap);
+	}
+	char *p = cpp->memo_key;
+	for(j = 0; j < nargs; ++j) {
+		for(i = 0; i < args[j].count; ++i) {
+			struct token *tok = &args[j].items[i].tok;
+			memcpy(p, tok->str, tok->len);
+			p += tok->len;
+			*p++ = 0;
+		}
+		*p++ = 1;
+	}
+	cpp->memo_key_len = len;
+}
+
+/* append the recorded expansion of m to out, if it is still valid and
+   was recorded for the arguments in memo_key */
+static int memo_replay(struct cpp *cpp, struct macro *m, struct toklist *out) {
+	struct memo *mo = m->memo;
+	unsigned i;
+	if(!mo || mo->key_len != cpp->memo_key_len ||
+	   (mo->key_len && memcmp(mo->key, cpp->memo_key, mo->key_len)))
+		return 0;
+	if(mo->gen != cpp->macro_gen) {
+		for(i = 0; i < mo->ndeps; ++i)
+			if(mo->deps[i].atom->gen != mo->deps[i].gen) {
+				memo_free(m);
+				return 0;
+			}
+		mo->gen = cpp->macro_gen;
+	}
+	toklist_append(cpp, out, &mo->l);
+	if(cpp->cond_rec)
+		for(i = 0; i < mo->ndeps; ++i) cond_dep(cpp, mo->deps[i].atom);
+	++m->memo_hits;
+	++cpp->memo_hits;
+	return 1;
+}
+
+/* start recording the expansion of m, read from the input of the base
+   frame along with its arguments, if any. what it yields only depends
+   on these and on the macros its tokens name, unless it reads on into
+   the input or expands __FILE__ or __LINE__. */
+static void memo_begin(struct cpp *cpp, struct macro *m) {
+	cpp->memo_m = m;
+	cpp->memo_start = frame_top(cpp)->out.count;
+	cpp->memo_ok = 1;
+	++cpp->memo_serial;
+	tglist_free_items(&cpp->memo_deps);
+}
+
+static void memo_dep(struct cpp *cpp, struct htok *ht) {
+	/* names that were never interned, of arguments or made up by
+	   pasting, need to be to watch them for a definition */
+	if(!ht->atom) ht->atom = tok_atom(cpp, &ht->tok, 1);
+	struct atom *a = ht->atom;
+	if(a->memo_mark == cpp->memo_serial) return;
+	a->memo_mark = cpp->memo_serial;
+	tglist_add(&cpp->memo_deps, ((struct memo_dep) {a, a->gen}));
+}
+
+/* the expansion being recorded is done, its tokens are those of the
+   output of the base frame from memo_start on */
+static void memo_end(struct cpp *cpp) {
+	struct macro *m = cpp->memo_m;
+	struct toklist *out = &frame_top(cpp)->out;
+	size_t i, len = 0, ndeps = tglist_getsize(&cpp->memo_deps);
+	cpp->memo_m = 0;
+	if(!cpp->memo_ok) return;
+	memo_free(m);
+	struct memo *mo = malloc(sizeof *mo + ndeps * sizeof *mo->deps);
+	mo->gen = cpp->macro_gen;
+	mo->ndeps = ndeps;
+	mo->l.count = mo->l.capa = out->count - cpp->memo_start;
+	mo->l.items = malloc(mo->l.count * sizeof *mo->l.items);
+	for(i = 0; i < ndeps; ++i) mo->deps[i] = tglist_get(&cpp->memo_deps, i);
+	/* the spellings may live in the pool, which is about to be reset */
+	for(i = cpp->memo_start; i < out->count; ++i)
+		len += out->items[i].tok.len + 1;
+	char *p = mo->key = malloc(cpp->memo_key_len + len + 1);
+	mo->key_len = cpp->memo_key_len;
+	if(mo->key_len) memcpy(p, cpp->memo_key, mo->key_len);
+	p += mo->key_len;
+	for(i = cpp->memo_start; i < out->count; ++i) {
+		struct htok ht = out->items[i];
+		memcpy(p, ht.tok.str, ht.tok.len);
+		p[ht.tok.len] = 0;
+		ht.tok.str = p;
+		ht.hs = 0;
+		p += ht.tok.len + 1;
+		mo->l.items[i - cpp->memo_start] = ht;
+	}
+	m->memo = mo;
+}
 
-	for(i=0; i < num_args; i++)
-		argvalues[i].f = open_memstream(&argvalues[i].buf, &argvalues[i].len);
+/* replay the expansion of m recorded for the same arguments, or start
+   recording this one. macros used just once, most of them, aren't
+   recorded, nor are those recorded time and again without ever being
+   replayed: their arguments keep changing. */
+static int memo_expand(struct cpp *cpp, struct macro *m, struct toklist *args, unsigned nargs, struct toklist *out) {
+	int record = m->memo_misses &&
+		(m->memo_misses < 16 || m->memo_misses < 4 * m->memo_hits);
+	if(m->memo || record) {
+		memo_key(cpp, args, nargs);
+		if(memo_replay(cpp, m, out)) return 1;
+	}
+	++m->memo_misses;
+	++cpp->memo_misses;
+	if(record) memo_begin(cpp, m);
+	return 0;
+}
+
+/* expand ht, if it names a macro: its expansion is pushed as a context
+   to be rescanned, or if the arguments need to be expanded first, a
+   frame is pushed for them. other tokens go to the output of the frame.
+   from_input is set if ht was read from the input of the frame. */
+static int expand_token(struct cpp *cpp, struct htok *ht, int from_input) {
+	struct frame *f = frame_top(cpp);
+	if(ht->tok.type == TT_IDENTIFIER) {
+		if(cpp->memo_m) memo_dep(cpp, ht);
+		if(cpp->cond_rec) {
+			if(!ht->atom) ht->atom = tok_atom(cpp, &ht->tok, 1);
+			cond_dep(cpp, ht->atom);
+		}
+	}
+	struct atom *a = ht->atom;
+	struct macro *m = a ? a->macro : 0;
+	/* "defined" is an operator of #if, see eval_defined() */
+	if(m && a->builtin == BI_DEFINED) m = 0;
+	if(!m || hs_contains(ht->hs, m)) {
+		toklist_push(cpp, &f->out, ht);
+		return 1;
+	}
+	macro_prepare(cpp, m->body);
+#ifdef DEBUG
+	dprintf(2, "expanding macro %s (%s)\n", a->name, m->body ? m->body->str_contents_buf : "");
+#endif
+
+	if(from_input && f->t) {
+		cpp->last_file = f->t->filename;
+		cpp->last_t = f->t;
+		cpp->last_off = tokenizer_ftello(f->t);
+	}
+	if(from_input && cpp->frame_count == 1 && !FUNCTIONLIKE(m) && !a->builtin)
+		if(memo_expand(cpp, m, 0, 0, &f->out)) return 1;
+	/* these depend on where the expansion happens */
+	if(a->builtin == BI_FILE || a->builtin == BI_LINE)
+		cpp->memo_ok = 0;
+	if(a->builtin == BI_FILE) {
+		size_t len = strlen(cpp->last_file) + 2;
+		char *buf = pool_alloc(cpp, len + 1);
+		sprintf(buf, "\"%s\"", cpp->last_file);
+		toklist_add(cpp, &f->out, &(struct token) {.type = TT_DQSTRING_LIT, .str = buf, .len = len}, 0);
+		return 1;
+	} else if(a->builtin == BI_LINE) {
+		char buf[64];
+		unsigned line = 0, column;
+		if(cpp->last_t) tokenizer_locate(cpp->last_t, cpp->last_off, &line, &column);
+		sprintf(buf, "%u", line);
+		toklist_add(cpp, &f->out, &(struct token) {.type = TT_DEC_INT_LIT, .str = pool_strndup(cpp, buf, strlen(buf)), .len = strlen(buf)}, 0);
+		return 1;
+	}
+
+	struct htok tht;
+	struct token *tok = &tht.tok;
+	unsigned num_args = MACRO_ARGCOUNT(m);
+	unsigned nargs = MACRO_VARIADIC(m) ? num_args + 1 : num_args;
+	struct toklist *args = toklists_new(cpp, nargs);
+	/* the tokens of the expansion can't expand m again, nor what
+	   the invocation as a whole couldn't */
+	const struct hideset *hs = ht->hs;
+	int in;
 
 	/* replace named arguments in the contents of the macro call */
 	if(FUNCTIONLIKE(m)) {
-		int ret;
-		if((ret = tokenizer_peek(t)) != '(') {
-			/* function-like macro shall not be expanded if not followed by '(' */
-			if(ret == EOF && rec_level > 0 && (ret = tchain_parens_follows(cpp, rec_level-1)) != -1) {
-				// warning("Replacement text involved subsequent text", t, 0);
-				t = cpp->tchain[ret];
-			} else {
-				emit(out, name);
-				goto cleanup;
-			}
+		/* function-like macro shall not be expanded if not followed by '(' */
+		if(frame_peek(cpp) != '(') {
+			toklist_push(cpp, &f->out, ht);
+			return 1;
 		}
-		ret = x_tokenizer_next(t, &tok);
-		assert(ret && is_char(&tok, '('));
+		frame_next(cpp, &tht, 1, &in);
+		assert(is_char(tok, '('));
 
 		unsigned curr_arg = 0, need_arg = 1, parens = 0;
-		int ws_count;
-		if(!tokenizer_skip_chars(t, " \t", &ws_count)) return 0;
+		int closed = 0;
+		if(!frame_skip_blanks(cpp)) goto fail;
 
 		int varargs = 0;
 		if(num_args == 1 && MACRO_VARIADIC(m)) varargs = 1;
 		while(1) {
-			int ret = tokenizer_next(t, &tok);
-			if(!ret) return 0;
-			if( tok.type == TT_EOF) {
+			int ret = frame_next(cpp, &tht, 1, &in);
+			if(ret < 0) goto fail;
+			if(!ret) {
 				dprintf(2, "warning EOF\n");
 				break;
 			}
-			if(!parens && is_char(&tok, ',') && !varargs) {
-				if(need_arg && !ws_count) {
+			if(!parens && is_char(tok, ',') && !varargs) {
+				if(need_arg) {
 					/* empty argument is OK */
 				}
 				need_arg = 1;
@@ -673,283 +1774,332 @@ static int expand_macro(struct cpp* cpp, struct tokenizer *t, FILE* out, const c
 				if(curr_arg + 1 == num_args && MACRO_VARIADIC(m)) {
 					varargs = 1;
 				} else if(curr_arg >= num_args) {
-					error("too many arguments for function macro", t, &tok);
-					return 0;
+					read_error(cpp, "too many arguments for function macro", tok);
+					goto fail;
 				}
-				ret = tokenizer_skip_chars(t, " \t", &ws_count);
-				if(!ret) return ret;
+				if(!frame_skip_blanks(cpp)) goto fail;
 				continue;
-			} else if(is_char(&tok, '(')) {
+			} else if(is_char(tok, '(')) {
 				++parens;
-			} else if(is_char(&tok, ')')) {
+			} else if(is_char(tok, ')')) {
 				if(!parens) {
 					if(curr_arg + num_args && curr_arg < num_args-1) {
-						error("too few args for function macro", t, &tok);
-						return 0;
+						read_error(cpp, "too few args for function macro", tok);
+						goto fail;
 					}
+					hs = hs_intersect(cpp, hs, tht.hs);
+					closed = 1;
 					break;
 				}
 				--parens;
-			} else if(is_char(&tok, '\\')) {
-				if(tokenizer_peek(t) == '\n') continue;
+			} else if(is_char(tok, '\\')) {
+				if(frame_peek(cpp) == '\n') continue;
 			}
 			need_arg = 0;
-			emit_token(argvalues[curr_arg].f, &tok, t->buf);
+			toklist_push(cpp, &args[curr_arg], &tht);
 		}
+		if(closed && from_input && cpp->frame_count == 1 && !a->builtin &&
+		   memo_expand(cpp, m, args, nargs, &f->out))
+			return 1;
 	}
-
-	for(i=0; i < num_args; i++) {
-		argvalues[i].f = freopen_r(argvalues[i].f, &argvalues[i].buf, &argvalues[i].len);
-		tokenizer_from_file(&argvalues[i].t, argvalues[i].f);
-#ifdef DEBUG
-		dprintf(2, "macro argument %i: %s\n", (int) i, argvalues[i].buf);
-#endif
+	hs = hs_add(cpp, hs, m);
+
+	f = frame_push(cpp);
+	f->m = m;
+	f->hs = hs;
+	f->args = args;
+	f->nargs = nargs;
+	if(!m->body) {
+		frame_pop(cpp);
+		return 1;
 	}
+	f->arg = next_xarg(f, 0);
+	if(f->arg == nargs) return finish_invocation(cpp);
+	/* expand the arguments first */
+	f->xargs = toklists_new(cpp, nargs);
+	f->in = &args[f->arg];
+	return 1;
+fail:
+	return 0;
+}
 
-	if(is_define) {
-		if(get_macro(cpp, argvalues[0].buf))
-			emit(out, "1");
-		else
-			emit(out, "0");
+/* expand the tokens of the base frame until it is done: for a file,
+   once the expansion of ht is, for a token list at its end. */
+static int expand_run(struct cpp *cpp, struct htok *ht, struct toklist *out) {
+	struct htok tht;
+	int from_input;
+	if(ht && !expand_token(cpp, ht, 1)) goto fail;
+	while(1) {
+		struct frame *f = frame_top(cpp);
+		int base = cpp->frame_count == 1;
+		if(cpp->memo_m && base && !ctx_current(cpp)) memo_end(cpp);
+		if(!frame_next(cpp, &tht, !base || !f->t, &from_input)) {
+			if(base) break;
+			/* argument done, on to the next one */
+			f->xargs[f->arg] = f->out;
+			f->out = (struct toklist) {0};
+			f->arg = next_xarg(f, f->arg + 1);
+			if(f->arg < f->nargs) {
+				f->in = &f->args[f->arg];
+				f->pos = 0;
+			} else if(!finish_invocation(cpp))
+				goto fail;
+			continue;
+		}
+		if(!expand_token(cpp, &tht, from_input)) goto fail;
 	}
+	*out = frame_top(cpp)->out;
+	frame_top(cpp)->out = (struct toklist) {0};
+	frame_pop(cpp);
+	return 1;
+fail:
+	cpp->memo_m = 0;
+	while(cpp->frame_count) frame_pop(cpp);
+	return 0;
+}
+
+/* macro-expand the invocation starting with ht, an identifier just
+   read from t, into out */
+static int expand_macro(struct cpp *cpp, struct tokenizer *t, struct htok *ht, struct toklist *out) {
+	struct frame *f = frame_push(cpp);
+	f->t = t;
+	return expand_run(cpp, ht, out);
+}
 
-	if(!m->str_contents) goto cleanup;
+/* macro-expand the tokens of in into out */
+static int expand_list(struct cpp *cpp, struct toklist *in, struct toklist *out) {
+	struct frame *f = frame_push(cpp);
+	f->in = in;
+	return expand_run(cpp, 0, out);
+}
 
-	struct FILE_container cwae = {0}; /* contents_with_args_expanded */
-	cwae.f = open_memstream(&cwae.buf, &cwae.len);
-	FILE* output = cwae.f;
+/* the tokens of #if expressions, classified once as they're read */
+enum eval_op {
+	EO_END = 0,	/* of the line */
+	EO_NUM,
+	EO_LPAREN,
+	EO_RPAREN,
+	EO_LNOT,
+	EO_COMPL,
+	EO_MUL,
+	EO_DIV,
+	EO_MOD,
+	EO_ADD,
+	EO_SUB,
+	EO_SHL,
+	EO_SHR,
+	EO_LT,
+	EO_GT,
+	EO_LE,
+	EO_GE,
+	EO_EQ,
+	EO_NE,
+	EO_AND,
+	EO_XOR,
+	EO_OR,
+	EO_LAND,
+	EO_LOR,
+	EO_COND,
+	EO_COLON,
+	EO_FLOAT,
+	EO_OTHER,
+};
 
-	struct tokenizer t2;
-	tokenizer_from_file(&t2, m->str_contents);
-	int hash_count = 0;
-	int ws_count = 0;
-	while(1) {
-		int ret;
-		ret = tokenizer_next(&t2, &tok);
-		if(!ret) return 0;
-		if(tok.type == TT_EOF) break;
-		if(tok.type == TT_IDENTIFIER) {
-			flush_whitespace(output, &ws_count);
-			char *id = t2.buf;
-			if(MACRO_VARIADIC(m) && !strcmp(t2.buf, "__VA_ARGS__")) {
-				id = "...";
-			}
-			size_t arg_nr = macro_arglist_pos(m, id);
-			if(arg_nr != (size_t) -1) {
-				tokenizer_rewind(&argvalues[arg_nr].t);
-				if(hash_count == 1) ret = stringify(cpp, &argvalues[arg_nr].t, output);
-				else while(1) {
-					ret = tokenizer_next(&argvalues[arg_nr].t, &tok);
-					if(!ret) return ret;
-					if(tok.type == TT_EOF) break;
-					emit_token(output, &tok, argvalues[arg_nr].t.buf);
-				}
-				hash_count = 0;
-			} else {
-				if(hash_count == 1) {
-		hash_err:
-					error("'#' is not followed by macro parameter", &t2, &tok);
-					return 0;
-				}
-				emit_token(output, &tok, t2.buf);
-			}
-		} else if(is_char(&tok, '#')) {
-			if(hash_count) {
-				goto hash_err;
-			}
-			while(1) {
-				++hash_count;
-				/* in a real cpp we'd need to look for '\\' first */
-				while(tokenizer_peek(&t2) == '\n') {
-					x_tokenizer_next(&t2, &tok);
-				}
-				if(tokenizer_peek(&t2) == '#') x_tokenizer_next(&t2, &tok);
-				else break;
-			}
-			if(hash_count == 1) flush_whitespace(output, &ws_count);
-			else if(hash_count > 2) {
-				error("only two '#' characters allowed for macro expansion", &t2, &tok);
-				return 0;
-			}
-			if(hash_count == 2)
-				ret = tokenizer_skip_chars(&t2, " \t\n", &ws_count);
-			else
-				ret = tokenizer_skip_chars(&t2, " \t", &ws_count);
+/* binding power of the binary operators. '(' only binds to fail. */
+static const unsigned char eval_bp[EO_OTHER + 1] = {
+	[EO_COND] = 3, [EO_LOR] = 4, [EO_LAND] = 5, [EO_OR] = 6, [EO_XOR] = 7,
+	[EO_AND] = 8, [EO_EQ] = 9, [EO_NE] = 9,
+	[EO_LT] = 10, [EO_GT] = 10, [EO_LE] = 10, [EO_GE] = 10,
+	[EO_SHL] = 11, [EO_SHR] = 11, [EO_ADD] = 12, [EO_SUB] = 12,
+	[EO_MUL] = 13, [EO_DIV] = 13, [EO_MOD] = 13, [EO_LPAREN] = 15,
+};
+#define EVAL_BP_UNARY 14
+
+/* names looked at to tell whether a dead operand can be skipped */
+#define CLOSED_BUDGET 32
+
+/* an #if expression, read, expanded and evaluated in one go */
+struct eval {
+	struct cpp *cpp;
+	struct tokenizer *t;
+	struct toklist l;	/* expansion being read */
+	size_t pos;
+	off_t off;	/* of the name it expands, for diagnostics */
+	int backslash, eol, from_line;
+	/* nesting of operands whose value doesn't matter. their macros
+	   aren't expanded where that can't change the parse. */
+	unsigned dead;
+	int err;
+	/* the token looked ahead at */
+	int peeked;
+	enum eval_op op;
+	intmax_t val;
+	struct token tok;
+};
 
-			if(!ret) return ret;
-			ws_count = 0;
+static void eval_error(struct eval *e, const char *err, struct token *tok) {
+	if(!e->err) error(err, e->t, tok);
+	e->err = 1;
+}
 
-		} else if(is_whitespace_token(&tok)) {
-			ws_count++;
-		} else {
-			if(hash_count == 1) goto hash_err;
-			flush_whitespace(output, &ws_count);
-			emit_token(output, &tok, t2.buf);
-		}
+/* whether the expansion of a name is a single operand, whatever
+   surrounds it: the name of no macro, or of one whose body is a
+   literal, an object-like name, or in parentheses, with the names in
+   it closed as well. */
+static int name_closed(struct cpp *cpp, struct atom *a, unsigned *budget) {
+	struct macro *m = a->macro;
+	unsigned i;
+	cond_dep(cpp, a);
+	if(!m) return 1;
+	if(a->builtin || !*budget) return 0;
+	--*budget;
+	macro_prepare(cpp, m->body);
+	if(!m->body || !m->body->closed) return 0;
+	for(i = 0; i < m->body->nops; ++i) {
+		struct atom *id = m->body->ops[i].atom;
+		if(!id) continue;
+		if(m->body->nops == 1 && id->macro && FUNCTIONLIKE(id->macro)) return 0;
+		if(!name_closed(cpp, id, budget)) return 0;
 	}
-	flush_whitespace(output, &ws_count);
-
-	/* we need to expand macros after the macro arguments have been inserted */
-	if(1) {
-		cwae.f = freopen_r(cwae.f, &cwae.buf, &cwae.len);
-#ifdef DEBUG
-		dprintf(2, "contents with args expanded: %s\n", cwae.buf);
-#endif
-		tokenizer_from_file(&cwae.t, cwae.f);
-		size_t mac_cnt = 0;
-		while(1) {
-			int ret = tokenizer_next(&cwae.t, &tok);
-			if(!ret) return ret;
-			if(tok.type == TT_EOF) break;
-			if(tok.type == TT_IDENTIFIER && get_macro(cpp, cwae.t.buf))
-				++mac_cnt;
-		}
+	return 1;
+}
 
-		tokenizer_rewind(&cwae.t);
-		struct macro_info *mcs = calloc(mac_cnt, sizeof(struct macro_info));
-		{
-			size_t mac_iter = 0;
-			get_macro_info(cpp, &cwae.t, mcs, &mac_iter, 0, 0, "null", visited, rec_level);
-			/* some of the macros might not expand at this stage (without braces)*/
-			while(mac_cnt && mcs[mac_cnt-1].name == 0)
-				--mac_cnt;
-		}
-		size_t i; int depth = 0;
-		for(i = 0; i < mac_cnt; ++i) {
-			if(mcs[i].nest > depth) depth = mcs[i].nest;
-		}
-		while(depth > -1) {
-			for(i = 0; i < mac_cnt; ++i) if(mcs[i].nest == depth) {
-				struct macro_info *mi = &mcs[i];
-				tokenizer_rewind(&cwae.t);
-				size_t j;
-				struct token utok;
-				for(j = 0; j < mi->first+1; ++j)
-					tokenizer_next(&cwae.t, &utok);
-				struct FILE_container t2 = {0}, tmp = {0};
-				t2.f = open_memstream(&t2.buf, &t2.len);
-				if(!expand_macro(cpp, &cwae.t, t2.f, mi->name, rec_level+1, visited))
-					return 0;
-				t2.f = freopen_r(t2.f, &t2.buf, &t2.len);
-				tokenizer_from_file(&t2.t, t2.f);
-				/* manipulating the stream in case more stuff has been consumed */
-				off_t cwae_pos = tokenizer_ftello(&cwae.t);
-				tokenizer_rewind(&cwae.t);
-#ifdef DEBUG
-				dprintf(2, "merging %s with %s\n", cwae.buf, t2.buf);
-#endif
-				int diff = mem_tokenizers_join(&cwae, &t2, &tmp, mi->first, cwae_pos);
-				free_file_container(&cwae);
-				free_file_container(&t2);
-				cwae = tmp;
-#ifdef DEBUG
-				dprintf(2, "result: %s\n", cwae.buf);
-#endif
-				if(diff == 0) continue;
-				for(j = 0; j < mac_cnt; ++j) {
-					if(j == i) continue;
-					struct macro_info *mi2 = &mcs[j];
-					/* modified element mi can be either inside, after or before
-					   another macro. the after case doesn't affect us. */
-					if(mi->first >= mi2->first && mi->last <= mi2->last) {
-						/* inside m2 */
-						mi2->last += diff;
-					} else if (mi->first < mi2->first) {
-						/* before m2 */
-						mi2->first += diff;
-						mi2->last += diff;
-					}
-				}
+/* next token of the line of the #if, blanks and line continuations
+   aside. returns 0 at the end of the line, -1 on error. */
+static int eval_line_token(struct eval *e, struct htok *ht) {
+	struct token *tok = &ht->tok;
+	*ht = (struct htok) {.tok.type = TT_EOF};
+	while(!e->eol) {
+		if(!tokenizer_next(e->t, tok)) return -1;
+		if(tok->type == TT_EOF) break;
+		if(tok->type == TT_SEP) {
+			if(tok->value == '\\') {
+				e->backslash = 1;
+				continue;
 			}
-			--depth;
+			if(tok->value == '\n' && !e->backslash) break;
+			e->backslash = 0;
+			if(tok->value == '\n' || is_whitespace_token(tok)) continue;
 		}
-		tokenizer_rewind(&cwae.t);
-		while(1) {
-			struct macro *ma;
-			tokenizer_next(&cwae.t, &tok);
-			if(tok.type == TT_EOF) break;
-			if(tok.type == TT_IDENTIFIER && tokenizer_peek(&cwae.t) == EOF &&
-			   (ma = get_macro(cpp, cwae.t.buf)) && FUNCTIONLIKE(ma) && tchain_parens_follows(cpp, rec_level) != -1
-			) {
-				int ret = expand_macro(cpp, &cwae.t, out, cwae.t.buf, rec_level+1, visited);
-				if(!ret) return ret;
-			} else
-				emit_token(out, &tok, cwae.t.buf);
-		}
-		free(mcs);
+		/* names are interned to watch them for a definition, if the
+		   condition is recorded */
+		if(tok->type == TT_IDENTIFIER && (ht->atom = tok_atom(e->cpp, tok, e->cpp->cond_rec))) {
+			tok->str = ht->atom->name;
+			cond_dep(e->cpp, ht->atom);
+		} else if(tok->str)
+			tok->str = pool_strndup(e->cpp, tok->str, tok->len);
+		return 1;
 	}
+	e->eol = 1;
+	return 0;
+}
 
-	free_file_container(&cwae);
+/* expand the macro named by ht into e->l. in a dead operand, a name
+   that expands to a single operand anyway is skipped along with its
+   arguments, and returns 1 to be read as 0. -1 on error. */
+static int eval_expand(struct eval *e, struct htok *ht) {
+	struct cpp *cpp = e->cpp;
+	struct macro *m = ht->atom->macro;
+	unsigned budget = CLOSED_BUDGET;
+	int ret;
+	e->l = (struct toklist) {0};
+	e->pos = 0;
+	e->off = ht->tok.offset;
+	if(e->dead && name_closed(cpp, ht->atom, &budget)) {
+		if(OBJECTLIKE(m) || tokenizer_peek(e->t) != '(') return 1;
+		struct toklist inv = {0};
+		struct htok tht;
+		unsigned parens = 0;
+		int closed = 1;
+		toklist_push(cpp, &inv, ht);
+		while((ret = eval_line_token(e, &tht)) > 0) {
+			toklist_push(cpp, &inv, &tht);
+			if(is_char(&tht.tok, '(')) ++parens;
+			else if(is_char(&tht.tok, ')') && !--parens) break;
+			else if(tht.atom && !name_closed(cpp, tht.atom, &budget)) closed = 0;
+		}
+		if(ret < 0) return -1;
+		if(parens) {
+			eval_error(e, "missing ')'", &tht.tok);
+			return -1;
+		}
+		if(closed) return 1;
+		/* the arguments could break the operand up after all. the
+		   list has no tokenizer to tell where it is, it's on the line */
+		cpp->last_file = e->t->filename;
+		cpp->last_t = e->t;
+		cpp->last_off = ht->tok.offset;
+		ret = expand_list(cpp, &inv, &e->l);
+	} else
+		ret = expand_macro(cpp, e->t, ht, &e->l);
+	return ret ? 0 : -1;
+}
 
-cleanup:
-	for(i=0; i < num_args; i++) {
-		fclose(argvalues[i].f);
-		free(argvalues[i].buf);
+/* whether the token read is followed by the character ch without
+   blanks in between, which is then consumed */
+static int eval_follows(struct eval *e, int ch) {
+	struct token tok;
+	if(!e->from_line) {
+		if(e->pos == e->l.count || !is_char(&e->l.items[e->pos].tok, ch)) return 0;
+		++e->pos;
+		return 1;
 	}
-	free(argvalues);
+	if(tokenizer_peek(e->t) != ch) return 0;
+	tokenizer_next(e->t, &tok);
 	return 1;
 }
 
-#define TT_LAND TT_CUSTOM+0
-#define TT_LOR TT_CUSTOM+1
-#define TT_LTE TT_CUSTOM+2
-#define TT_GTE TT_CUSTOM+3
-#define TT_SHL TT_CUSTOM+4
-#define TT_SHR TT_CUSTOM+5
-#define TT_EQ TT_CUSTOM+6
-#define TT_NEQ TT_CUSTOM+7
-#define TT_LT TT_CUSTOM+8
-#define TT_GT TT_CUSTOM+9
-#define TT_BAND TT_CUSTOM+10
-#define TT_BOR TT_CUSTOM+11
-#define TT_XOR TT_CUSTOM+12
-#define TT_NEG TT_CUSTOM+13
-#define TT_PLUS TT_CUSTOM+14
-#define TT_MINUS TT_CUSTOM+15
-#define TT_MUL TT_CUSTOM+16
-#define TT_DIV TT_CUSTOM+17
-#define TT_MOD TT_CUSTOM+18
-#define TT_LPAREN TT_CUSTOM+19
-#define TT_RPAREN TT_CUSTOM+20
-#define TT_LNOT TT_CUSTOM+21
-
-#define TTINT(X) X-TT_CUSTOM
-#define TTENT(X, Y) [TTINT(X)] = Y
-
-static int bp(int tokentype) {
-	static const int bplist[] = {
-		TTENT(TT_LOR, 1 << 4),
-		TTENT(TT_LAND, 1 << 5),
-		TTENT(TT_BOR, 1 << 6),
-		TTENT(TT_XOR, 1 << 7),
-		TTENT(TT_BAND, 1 << 8),
-		TTENT(TT_EQ, 1 << 9),
-		TTENT(TT_NEQ, 1 << 9),
-		TTENT(TT_LTE, 1 << 10),
-		TTENT(TT_GTE, 1 << 10),
-		TTENT(TT_LT, 1 << 10),
-		TTENT(TT_GT, 1 << 10),
-		TTENT(TT_SHL, 1 << 11),
-		TTENT(TT_SHR, 1 << 11),
-		TTENT(TT_PLUS, 1 << 12),
-		TTENT(TT_MINUS, 1 << 12),
-		TTENT(TT_MUL, 1 << 13),
-		TTENT(TT_DIV, 1 << 13),
-		TTENT(TT_MOD, 1 << 13),
-		TTENT(TT_NEG, 1 << 14),
-		TTENT(TT_LNOT, 1 << 14),
-		TTENT(TT_LPAREN, 1 << 15),
-//		TTENT(TT_RPAREN, 1 << 15),
-//		TTENT(TT_LPAREN, 0),
-		TTENT(TT_RPAREN, 0),
-	};
-	if(TTINT(tokentype) < sizeof(bplist)/sizeof(bplist[0])) return bplist[TTINT(tokentype)];
-	return 0;
+static enum eval_op eval_punct(struct eval *e, int ch) {
+	switch(ch) {
+		case '(': return EO_LPAREN;
+		case ')': return EO_RPAREN;
+		case '~': return EO_COMPL;
+		case '*': return EO_MUL;
+		case '/': return EO_DIV;
+		case '%': return EO_MOD;
+		case '+': return EO_ADD;
+		case '-': return EO_SUB;
+		case '^': return EO_XOR;
+		case '?': return EO_COND;
+		case ':': return EO_COLON;
+		case '!': return eval_follows(e, '=') ? EO_NE : EO_LNOT;
+		case '=': return eval_follows(e, '=') ? EO_EQ : EO_OTHER;
+		case '&': return eval_follows(e, '&') ? EO_LAND : EO_AND;
+		case '|': return eval_follows(e, '|') ? EO_LOR : EO_OR;
+		case '<':
+			if(eval_follows(e, '<')) return EO_SHL;
+			return eval_follows(e, '=') ? EO_LE : EO_LT;
+		case '>':
+			if(eval_follows(e, '>')) return EO_SHR;
+			return eval_follows(e, '=') ? EO_GE : EO_GT;
+		default: return EO_OTHER;
+	}
 }
 
-static int expr(struct tokenizer *t, int rbp, int *err);
+/* the operand of "defined", a name or one in parentheses, is read
+   from the line as is */
+static int eval_defined(struct eval *e) {
+	struct htok ht;
+	int ret, paren = 0;
+	if((ret = eval_line_token(e, &ht)) > 0 && is_char(&ht.tok, '(')) {
+		paren = 1;
+		ret = eval_line_token(e, &ht);
+	}
+	if(ret < 0) return 0;
+	if(!ret || ht.tok.type != TT_IDENTIFIER) {
+		eval_error(e, "expected identifier after defined", &ht.tok);
+		return 0;
+	}
+	e->val = ht.atom && ht.atom->macro;
+	if(paren && ((ret = eval_line_token(e, &ht)) <= 0 || !is_char(&ht.tok, ')'))) {
+		if(ret >= 0) eval_error(e, "missing ')'", &ht.tok);
+		return 0;
+	}
+	return 1;
+}
 
-static int charlit_to_int(const char *lit) {
+static intmax_t charlit_to_int(const char *lit) {
+	if(*lit == 'L') ++lit;
 	if(lit[1] == '\\') switch(lit[2]) {
 		case '0': return 0;
 		case 'n': return 10;
@@ -961,210 +2111,473 @@ static int charlit_to_int(const char *lit) {
 	return lit[1];
 }
 
-static int nud(struct tokenizer *t, struct token *tok, int *err) {
-	switch((unsigned) tok->type) {
-		case TT_IDENTIFIER: return 0;
+static intmax_t eval_number(struct token *tok) {
+	char buf[128];
+	size_t len = tok->len < sizeof buf ? tok->len : sizeof buf - 1;
+	memcpy(buf, tok->str, len);
+	buf[len] = 0;
+	/* the suffixes are ignored, and values beyond INTMAX_MAX wrap */
+	return (intmax_t) strtoumax(buf, NULL, 0);
+}
+
+/* read and classify the next token of the expression, from the
+   expansion being read, or else from the line, expanding the macros
+   there. returns 0 on error. */
+static int eval_lex(struct eval *e) {
+	struct htok ht;
+	int ret;
+	e->val = 0;
+	while(1) {
+		if(e->pos < e->l.count) {
+			ht = e->l.items[e->pos++];
+			if(is_whitespace_token(&ht.tok) || is_char(&ht.tok, '\n')) continue;
+			ht.tok.offset = e->off;
+			e->from_line = 0;
+			break;
+		}
+		ret = eval_line_token(e, &ht);
+		e->tok = ht.tok;
+		if(ret <= 0) {
+			e->op = EO_END;
+			return !ret;
+		}
+		e->from_line = 1;
+		if(ht.atom && ht.atom->builtin == BI_DEFINED) {
+			e->op = EO_NUM;
+			return eval_defined(e);
+		}
+		if(!ht.atom || !ht.atom->macro) break;
+		ret = eval_expand(e, &ht);
+		if(ret < 0) return 0;
+		if(ret) break;
+	}
+	e->tok = ht.tok;
+	switch((unsigned) ht.tok.type) {
+		case TT_IDENTIFIER:
+			e->op = EO_NUM;
+			break;
 		case TT_WIDECHAR_LIT:
-		case TT_SQSTRING_LIT:  return charlit_to_int(t->buf);
+		case TT_SQSTRING_LIT:
+			e->op = EO_NUM;
+			e->val = charlit_to_int(ht.tok.str);
+			break;
 		case TT_HEX_INT_LIT:
 		case TT_OCT_INT_LIT:
 		case TT_DEC_INT_LIT:
-			return strtol(t->buf, NULL, 0);
-		case TT_NEG:   return ~ expr(t, bp(tok->type), err);
-		case TT_PLUS:  return expr(t, bp(tok->type), err);
-		case TT_MINUS: return - expr(t, bp(tok->type), err);
-		case TT_LNOT:  return !expr(t, bp(tok->type), err);
-		case TT_LPAREN: {
-			int inner = expr(t, 0, err);
-			if(0!=expect(t, TT_RPAREN, (const char*[]){")", 0}, tok)) {
-				error("missing ')'", t, tok);
-				return 0;
-			}
-			return inner;
-		}
+			e->op = EO_NUM;
+			e->val = eval_number(&ht.tok);
+			break;
 		case TT_FLOAT_LIT:
-			error("floating constant in preprocessor expression", t, tok);
-			*err = 1;
+			e->op = EO_FLOAT;
+			break;
+		case TT_SEP:
+			e->op = eval_punct(e, ht.tok.value);
+			break;
+		default:
+			e->op = EO_OTHER;
+	}
+	return 1;
+}
+
+static enum eval_op eval_peek(struct eval *e) {
+	if(!e->peeked) {
+		e->peeked = 1;
+		if(!eval_lex(e)) {
+			e->err = 1;
+			e->op = EO_END;
+		}
+	}
+	return e->op;
+}
+
+static enum eval_op eval_next(struct eval *e) {
+	enum eval_op op = eval_peek(e);
+	e->peeked = 0;
+	return op;
+}
+
+static intmax_t eval_expr(struct eval *e, int rbp);
+
+static intmax_t eval_nud(struct eval *e) {
+	intmax_t inner;
+	switch(eval_next(e)) {
+		case EO_NUM:   return e->val;
+		case EO_COMPL: return ~eval_expr(e, EVAL_BP_UNARY);
+		case EO_ADD:   return eval_expr(e, EVAL_BP_UNARY);
+		case EO_SUB:   return -(uintmax_t) eval_expr(e, EVAL_BP_UNARY);
+		case EO_LNOT:  return !eval_expr(e, EVAL_BP_UNARY);
+		case EO_LPAREN:
+			inner = eval_expr(e, 0);
+			if(eval_next(e) != EO_RPAREN) eval_error(e, "missing ')'", &e->tok);
+			return inner;
+		case EO_FLOAT:
+			eval_error(e, "floating constant in preprocessor expression", &e->tok);
 			return 0;
-		case TT_RPAREN:
 		default:
-			error("unexpected token", t, tok);
-			*err = 1;
+			eval_error(e, "unexpected token", &e->tok);
 			return 0;
 	}
 }
 
-static int led(struct tokenizer *t, int left, struct token *tok, int *err) {
-	int right;
-	switch((unsigned) tok->type) {
-		case TT_LAND:
-		case TT_LOR:
-			right = expr(t, bp(tok->type), err);
-			if(tok->type == TT_LAND) return left && right;
-			return left || right;
-		case TT_LTE:  return left <= expr(t, bp(tok->type), err);
-		case TT_GTE:  return left >= expr(t, bp(tok->type), err);
-		case TT_SHL:  return left << expr(t, bp(tok->type), err);
-		case TT_SHR:  return left >> expr(t, bp(tok->type), err);
-		case TT_EQ:   return left == expr(t, bp(tok->type), err);
-		case TT_NEQ:  return left != expr(t, bp(tok->type), err);
-		case TT_LT:   return left <  expr(t, bp(tok->type), err);
-		case TT_GT:   return left >  expr(t, bp(tok->type), err);
-		case TT_BAND: return left &  expr(t, bp(tok->type), err);
-		case TT_BOR:  return left |  expr(t, bp(tok->type), err);
-		case TT_XOR:  return left ^  expr(t, bp(tok->type), err);
-		case TT_PLUS: return left +  expr(t, bp(tok->type), err);
-		case TT_MINUS:return left -  expr(t, bp(tok->type), err);
-		case TT_MUL:  return left *  expr(t, bp(tok->type), err);
-		case TT_DIV:
-		case TT_MOD:
-			right = expr(t, bp(tok->type), err);
-			if(right == 0)  {
-				error("eval: div by zero", t, tok);
-				*err = 1;
+/* an operand whose value doesn't matter */
+static intmax_t eval_dead(struct eval *e, int rbp, int dead) {
+	e->dead += dead;
+	intmax_t ret = eval_expr(e, rbp);
+	e->dead -= dead;
+	return ret;
+}
+
+static intmax_t eval_led(struct eval *e, enum eval_op op, intmax_t left) {
+	struct token optok = e->tok;
+	int bp = eval_bp[op];
+	intmax_t right, mid;
+	switch(op) {
+		case EO_LAND: return eval_dead(e, bp, !left) && left;
+		case EO_LOR:  return eval_dead(e, bp, !!left) || left;
+		case EO_COND:
+			mid = eval_dead(e, 0, !left);
+			if(eval_next(e) != EO_COLON) {
+				eval_error(e, "missing ':'", &e->tok);
+				return 0;
 			}
-			else if(tok->type == TT_DIV) return left / right;
-			else if(tok->type == TT_MOD) return left % right;
+			right = eval_dead(e, bp - 1, !!left);
+			return left ? mid : right;
+		case EO_LPAREN:
+			eval_error(e, "eval: unexpect token", &optok);
 			return 0;
 		default:
-			error("eval: unexpect token", t, tok);
-			*err = 1;
+			break;
+	}
+	right = eval_expr(e, bp);
+	/* wrapping, rather than overflowing */
+	uintmax_t l = left, r = right;
+	switch(op) {
+		case EO_MUL: return l * r;
+		case EO_ADD: return l + r;
+		case EO_SUB: return l - r;
+		case EO_SHL: return r < sizeof l * CHAR_BIT ? l << r : 0;
+		case EO_SHR: return r < sizeof l * CHAR_BIT ? left >> r : -(left < 0);
+		case EO_LT:  return left <  right;
+		case EO_GT:  return left >  right;
+		case EO_LE:  return left <= right;
+		case EO_GE:  return left >= right;
+		case EO_EQ:  return left == right;
+		case EO_NE:  return left != right;
+		case EO_AND: return left &  right;
+		case EO_XOR: return left ^  right;
+		case EO_OR:  return left |  right;
+		case EO_DIV:
+		case EO_MOD:
+			if(right == 0) {
+				if(!e->dead) eval_error(e, "eval: div by zero", &optok);
+				return 0;
+			}
+			if(right == -1) return op == EO_DIV ? -l : 0;
+			return op == EO_DIV ? left / right : left % right;
+		default:
 			return 0;
 	}
 }
 
+static intmax_t eval_expr(struct eval *e, int rbp) {
+	intmax_t left = eval_nud(e);
+	while(!e->err && eval_bp[eval_peek(e)] > rbp)
+		left = eval_led(e, eval_next(e), left);
+	return left;
+}
 
-static int tokenizer_peek_next_non_ws(struct tokenizer *t, struct token *tok)
-{
-	int ret;
-	while(1) {
-		ret = tokenizer_peek_token(t, tok);
-		if(is_whitespace_token(tok))
-			x_tokenizer_next(t, tok);
-		else break;
+/* the result of an #if or #elif. it holds as long as none of the
+   names read evaluating it is (re|un)defined. */
+struct cond_memo {
+	const char *file;	/* in the arena */
+	off_t off;
+	unsigned hash;
+	unsigned gen;	/* cpp->macro_gen when it was last found valid */
+	int result;
+	unsigned ndeps;
+	struct memo_dep deps[];
+};
+
+#define COND_HASH(F, O) (((F) ^ (unsigned) (O)) * 16777619u)
+
+static void grow_conds(struct cpp *cpp) {
+	size_t i, j, n = cpp->cond_cap ? cpp->cond_cap * 2 : 256;
+	struct cond_memo **slot = calloc(n, sizeof *slot);
+	for(i = 0; i < cpp->cond_cap; ++i) {
+		struct cond_memo *c = cpp->cond_slot[i];
+		if(!c) continue;
+		for(j = c->hash & (n - 1); slot[j]; j = (j + 1) & (n - 1));
+		slot[j] = c;
 	}
-	return ret;
+	free(cpp->cond_slot);
+	cpp->cond_slot = slot;
+	cpp->cond_cap = n;
 }
 
-static int expr(struct tokenizer *t, int rbp, int*err) {
-	struct token tok;
-	int ret = skip_next_and_ws(t, &tok);
-	if(tok.type == TT_EOF) return 0;
-	int left = nud(t, &tok, err);
-	while(1) {
-		ret = tokenizer_peek_next_non_ws(t, &tok);
-		if(bp(tok.type) <= rbp) break;
-		ret = tokenizer_next(t, &tok);
-		if(tok.type == TT_EOF) break;
-		left = led(t, left, &tok, err);
+/* the slot of the result of the condition at off in file */
+static struct cond_memo **cond_slot(struct cpp *cpp, const char *file, off_t off, unsigned hash) {
+	struct cond_memo *c;
+	if(2 * cpp->cond_count >= cpp->cond_cap) grow_conds(cpp);
+	size_t mask = cpp->cond_cap - 1, i = hash & mask;
+	for(; (c = cpp->cond_slot[i]); i = (i + 1) & mask)
+		if(c->hash == hash && c->off == off && (c->file == file || !strcmp(c->file, file))) break;
+	return &cpp->cond_slot[i];
+}
+
+static int cond_valid(struct cpp *cpp, struct cond_memo *c) {
+	unsigned i;
+	if(c->gen == cpp->macro_gen) return 1;
+	for(i = 0; i < c->ndeps; ++i)
+		if(c->deps[i].atom->gen != c->deps[i].gen) return 0;
+	c->gen = cpp->macro_gen;
+	return 1;
+}
+
+/* keep the result just evaluated in slot, with the names recorded */
+static void cond_store(struct cpp *cpp, struct cond_memo **slot, const char *file, off_t off, unsigned hash, int result) {
+	size_t i, ndeps = tglist_getsize(&cpp->cond_deps);
+	struct cond_memo *c = malloc(sizeof *c + ndeps * sizeof *c->deps);
+	*c = (struct cond_memo) {.file = file, .off = off, .hash = hash, .gen = cpp->macro_gen, .result = result, .ndeps = ndeps};
+	for(i = 0; i < ndeps; ++i) c->deps[i] = tglist_get(&cpp->cond_deps, i);
+	if(*slot) free(*slot);
+	else ++cpp->cond_count;
+	*slot = c;
+}
+
+/* a file is about to be read: conditions are only kept for files read
+   more than once, most are read once. an entry at offset -1 marks a
+   file as seen, and holds its name for the entries of its conditions. */
+static void cond_enter(struct cpp *cpp, const char *fn) {
+	unsigned fhash = tokenizer_hash(fn, strlen(fn));
+	unsigned hash = COND_HASH(fhash, -1);
+	struct cond_memo **slot = cond_slot(cpp, fn, -1, hash);
+	cpp->cond_file = 0;
+	if(*slot) {
+		cpp->cond_file = (*slot)->file;
+		cpp->cond_fhash = fhash;
+		return;
 	}
-	(void) ret;
-	return left;
+	cpp->cond_deps.count = 0;
+	cond_store(cpp, slot, arena_dup(cpp, fn, strlen(fn) + 1), -1, hash, -1);
 }
 
-static int do_eval(struct tokenizer *t, int *result) {
-	tokenizer_register_custom_token(t, TT_LAND, "&&");
-	tokenizer_register_custom_token(t, TT_LOR, "||");
-	tokenizer_register_custom_token(t, TT_LTE, "<=");
-	tokenizer_register_custom_token(t, TT_GTE, ">=");
-	tokenizer_register_custom_token(t, TT_SHL, "<<");
-	tokenizer_register_custom_token(t, TT_SHR, ">>");
-	tokenizer_register_custom_token(t, TT_EQ, "==");
-	tokenizer_register_custom_token(t, TT_NEQ, "!=");
-
-	tokenizer_register_custom_token(t, TT_LT, "<");
-	tokenizer_register_custom_token(t, TT_GT, ">");
-
-	tokenizer_register_custom_token(t, TT_BAND, "&");
-	tokenizer_register_custom_token(t, TT_BOR, "|");
-	tokenizer_register_custom_token(t, TT_XOR, "^");
-	tokenizer_register_custom_token(t, TT_NEG, "~");
-
-	tokenizer_register_custom_token(t, TT_PLUS, "+");
-	tokenizer_register_custom_token(t, TT_MINUS, "-");
-	tokenizer_register_custom_token(t, TT_MUL, "*");
-	tokenizer_register_custom_token(t, TT_DIV, "/");
-	tokenizer_register_custom_token(t, TT_MOD, "%");
-
-	tokenizer_register_custom_token(t, TT_LPAREN, "(");
-	tokenizer_register_custom_token(t, TT_RPAREN, ")");
-	tokenizer_register_custom_token(t, TT_LNOT, "!");
-
-	int err = 0;
-	*result = expr(t, 0, &err);
-#ifdef DEBUG
-	dprintf(2, "eval result: %d\n", *result);
-#endif
-	return !err;
+static void cond_free(struct cpp *cpp) {
+	size_t i;
+	for(i = 0; i < cpp->cond_cap; ++i) free(cpp->cond_slot[i]);
+	free(cpp->cond_slot);
+	cpp->cond_slot = 0;
+	cpp->cond_cap = cpp->cond_count = 0;
+	cpp->cond_file = 0;
+	tglist_free_items(&cpp->cond_deps);
 }
 
-static int evaluate_condition(struct cpp *cpp, struct tokenizer *t, int *result, char *visited[]) {
-	int ret, backslash_seen = 0;
+/* evaluate the condition of an #if or #elif into result. files read
+   again, included more than once, likely test the same conditions
+   with the same macros: the result is reused then, and the line
+   skipped without expanding anything. */
+static int evaluate_condition(struct cpp *cpp, struct tokenizer *t, int *result) {
 	struct token curr;
-	char *bufp;
-	size_t size;
-	int tflags = tokenizer_get_flags(t);
-	tokenizer_set_flags(t, tflags | TF_PARSE_WIDE_STRINGS);
-	ret = tokenizer_next(t, &curr);
-	if(!ret) return ret;
+	struct eval e = {.cpp = cpp, .t = t};
+	intmax_t value = 0;
+	if(!tokenizer_next(t, &curr)) return 0;
 	if(!is_whitespace_token(&curr)) {
 		error("expected whitespace after if/elif", t, &curr);
 		return 0;
 	}
-	FILE *f = open_memstream(&bufp, &size);
-	while(1) {
-		ret = tokenizer_next(t, &curr);
-		if(!ret) return ret;
-		if(curr.type == TT_IDENTIFIER) {
-			if(!expand_macro(cpp, t, f, t->buf, -1, visited)) return 0;
-		} else if(curr.type == TT_SEP) {
-			if(curr.value == '\\')
-				backslash_seen = 1;
-			else {
-				if(curr.value == '\n') {
-					if(!backslash_seen) break;
-				} else {
-					emit_token(f, &curr, t->buf);
-				}
-				backslash_seen = 0;
-			}
-		} else {
-			emit_token(f, &curr, t->buf);
+	const char *file = cpp->cond_file;
+	off_t off = 0;
+	unsigned hash = 0;
+	struct cond_memo **slot = 0;
+	if(file) {
+		off = tokenizer_ftello(t);
+		hash = COND_HASH(cpp->cond_fhash, off);
+		slot = cond_slot(cpp, file, off, hash);
+		if(*slot && cond_valid(cpp, *slot)) {
+			++cpp->cond_hits;
+			*result = (*slot)->result;
+			return tokenizer_read_line(t, &curr);
 		}
+		cpp->cond_deps.count = 0;
+		++cpp->cond_serial;
+		cpp->cond_rec = 1;
 	}
-	f = freopen_r(f, &bufp, &size);
-	if(!f || size == 0) {
-		error("#(el)if with no expression", t, &curr);
-		return 0;
-	}
+	++cpp->cond_misses;
+	int tflags = tokenizer_get_flags(t);
+	tokenizer_set_flags(t, tflags | TF_PARSE_WIDE_STRINGS);
+	if(eval_peek(&e) == EO_END)
+		eval_error(&e, "#(el)if with no expression", &e.tok);
+	else
+		value = eval_expr(&e, 0);
+	if(!e.err && eval_peek(&e) != EO_END)
+		eval_error(&e, "unexpected token", &e.tok);
+	cpp->cond_rec = 0;
+	pool_reset(cpp);
+	tokenizer_set_flags(t, tflags);
 #ifdef DEBUG
-	dprintf(2, "evaluating condition %s\n", bufp);
+	dprintf(2, "eval result: %jd\n", value);
 #endif
-	struct tokenizer t2;
-	tokenizer_from_file(&t2, f);
-	ret = do_eval(&t2, result);
-	fclose(f);
-	free(bufp);
-	tokenizer_set_flags(t, tflags);
-	return ret;
+	*result = value != 0;
+	if(e.err) return 0;
+	if(slot) cond_store(cpp, slot, file, off, hash, *result);
+	return 1;
+}
+
+/* where the conditional directives of a file are: for each #if,
+   #ifdef, #ifndef, #elif and #else, the line of the next directive of
+   its group. it's found the first time a file is read in a run, and as
+   long as the file is unchanged, later reads jump over inactive blocks
+   with it instead of scanning them for the directives. */
+struct cond_jump {
+	off_t from, to;	/* offsets of the lines */
+};
+
+struct file_index {
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	time_t mtime;
+	size_t count;
+	struct cond_jump jumps[];	/* by from */
+};
+
+#define FILE_HASH(D, I) (((unsigned) (D) * 31 + (unsigned) (I)) * 2654435761u)
+
+/* the conditional structure of the file being read: known from an
+   earlier read, or being recorded */
+struct cond_scan {
+	struct file_index *known;
+	size_t next;
+	int record;
+	tglist(struct cond_jump) found;
+	tglist(size_t) open;	/* groups with their next directive to come */
+	/* how far the group that may guard the file has been read, and
+	   what's output outside of it */
+	int guard_state;
+	struct atom *guard;
+	tglist(char) outside;
+};
+
+enum guard_state {
+	GUARD_BEFORE = 0,
+	GUARD_IN,
+	GUARD_AFTER,
+	GUARD_NONE,	/* the file isn't guarded */
+};
+
+static void grow_file_indexes(struct cpp *cpp) {
+	size_t i, j, n = cpp->index_cap ? cpp->index_cap * 2 : 64;
+	struct file_index **slot = calloc(n, sizeof *slot);
+	for(i = 0; i < cpp->index_cap; ++i) {
+		struct file_index *fi = cpp->index_slot[i];
+		if(!fi) continue;
+		for(j = FILE_HASH(fi->dev, fi->ino) & (n - 1); slot[j]; j = (j + 1) & (n - 1));
+		slot[j] = fi;
+	}
+	free(cpp->index_slot);
+	cpp->index_slot = slot;
+	cpp->index_cap = n;
+}
+
+/* the slot of the index of the file st describes. it may hold one of
+   an earlier version of the file. */
+static struct file_index **file_index_slot(struct cpp *cpp, const struct stat *st) {
+	struct file_index *fi;
+	if(2 * cpp->index_count >= cpp->index_cap) grow_file_indexes(cpp);
+	size_t mask = cpp->index_cap - 1, i = FILE_HASH(st->st_dev, st->st_ino) & mask;
+	for(; (fi = cpp->index_slot[i]); i = (i + 1) & mask)
+		if(fi->ino == st->st_ino && fi->dev == st->st_dev) break;
+	return &cpp->index_slot[i];
+}
+
+/* set up cs for reading the file st describes */
+static void file_index_start(struct cpp *cpp, const struct stat *st, struct cond_scan *cs) {
+	struct file_index *fi = *file_index_slot(cpp, st);
+	if(fi && fi->mtime == st->st_mtime && fi->size == st->st_size) cs->known = fi;
+	else cs->record = 1;
 }
 
-static void free_visited(char *visited[]) {
+/* keep the structure recorded reading the file st describes */
+static void file_index_store(struct cpp *cpp, const struct stat *st, struct cond_scan *cs) {
+	struct file_index **slot = file_index_slot(cpp, st), *fi;
+	size_t n = tglist_getsize(&cs->found);
+	if(!(fi = malloc(sizeof *fi + n * sizeof *fi->jumps))) return;
+	*fi = (struct file_index) {.dev = st->st_dev, .ino = st->st_ino, .size = st->st_size, .mtime = st->st_mtime, .count = n};
+	if(n) memcpy(fi->jumps, cs->found.items, n * sizeof *fi->jumps);
+	if(*slot) free(*slot);
+	else ++cpp->index_count;
+	*slot = fi;
+}
+
+static void file_index_free(struct cpp *cpp) {
 	size_t i;
-	for(i=0; i< MAX_RECURSION; i++)
-		if(visited[i]) free(visited[i]);
+	for(i = 0; i < cpp->index_cap; ++i) free(cpp->index_slot[i]);
+	free(cpp->index_slot);
+	cpp->index_slot = 0;
+	cpp->index_cap = cpp->index_count = 0;
+}
 
+/* note the conditional directive dir on the line at offset line */
+static void cond_record(struct cond_scan *cs, int dir, off_t line) {
+	if(!cs->record) return;
+	if(dir == DIR_ELIF || dir == DIR_ELSE || dir == DIR_ENDIF) {
+		/* the structure is of no use if it isn't sound */
+		if(!cs->open.count) {
+			cs->record = 0;
+			return;
+		}
+		tglist_get(&cs->found, tglist_get(&cs->open, --cs->open.count)).to = line;
+		if(dir == DIR_ENDIF) return;
+	}
+	tglist_add(&cs->open, tglist_getsize(&cs->found));
+	tglist_add(&cs->found, ((struct cond_jump) {line, -1}));
 }
 
-int parse_file(struct cpp *cpp, FILE *f, const char *fn, FILE *out) {
-	struct tokenizer t;
+/* the line of the next directive of the group of the one on the line
+   at offset line, or -1 if it isn't known. lines are asked for in the
+   order of the file. */
+static off_t cond_jump(struct cond_scan *cs, off_t line) {
+	struct file_index *fi = cs->known;
+	if(!fi) return -1;
+	while(cs->next < fi->count && fi->jumps[cs->next].from < line) ++cs->next;
+	if(cs->next < fi->count && fi->jumps[cs->next].from == line)
+		return fi->jumps[cs->next].to;
+	return -1;
+}
+
+/* note the directive dir, read at if_level */
+static void guard_directive(struct cond_scan *cs, int dir, int if_level) {
+	switch(cs->guard_state) {
+	case GUARD_BEFORE:
+		cs->guard_state = dir == DIR_IFNDEF ? GUARD_IN : GUARD_NONE;
+		break;
+	case GUARD_IN:
+		if(if_level != 1) break;
+		if(dir == DIR_ENDIF) cs->guard_state = GUARD_AFTER;
+		else if(dir == DIR_ELIF || dir == DIR_ELSE) cs->guard_state = GUARD_NONE;
+		break;
+	case GUARD_AFTER:
+		cs->guard_state = GUARD_NONE;
+		break;
+	}
+}
+
+/* note tok, output after ws blanks. outside of the guard only blanks
+   and newlines may be. */
+static void guard_token(struct cond_scan *cs, struct token *tok, int ws) {
+	size_t i;
+	if(cs->guard_state == GUARD_IN || cs->guard_state == GUARD_NONE) return;
+	if(!is_whitespace_token(tok) && !is_char(tok, '\n')) {
+		cs->guard_state = GUARD_NONE;
+		return;
+	}
+	for(; ws > 0; --ws) tglist_add(&cs->outside, ' ');
+	for(i = 0; i < tok->len; ++i) tglist_add(&cs->outside, tok->str[i]);
+}
+
+static int parse_tokens(struct cpp *cpp, struct tokenizer *t, FILE *out, struct cond_scan *cs) {
 	struct token curr;
-	tokenizer_init(&t, f, TF_PARSE_STRINGS);
-	tokenizer_set_filename(&t, fn);
-	tokenizer_register_marker(&t, MT_MULTILINE_COMMENT_START, "/*"); /**/
-	tokenizer_register_marker(&t, MT_MULTILINE_COMMENT_END, "*/");
-	tokenizer_register_marker(&t, MT_SINGLELINE_COMMENT_START, "//");
 	int ret, newline=1, ws_count = 0;
+	off_t line = 0, to;
 
 	int if_level = 0, if_level_active = 0, if_level_satisfied = 0;
 
@@ -1182,72 +2595,79 @@ int parse_file(struct cpp *cpp, FILE *f, const char *fn, FILE *out) {
 	} while(0)
 #define skip_conditional_block (if_level > if_level_active)
 
-	static const char* directives[] = {"include", "error", "warning", "define", "undef", "if", "elif", "else", "ifdef", "ifndef", "endif", "line", "pragma", 0};
-	while((ret = tokenizer_next(&t, &curr)) && curr.type != TT_EOF) {
-		newline = curr.column == 0;
+	while(1) {
+		/* inactive blocks are only looked at for the directives
+		   that nest or end them */
+		if(skip_conditional_block && !tokenizer_skip_lines(t, '#', cond_directive_names)) break;
+		if(!(ret = tokenizer_next(t, &curr)) || curr.type == TT_EOF) break;
+		newline = curr.line_start;
 		if(newline) {
-			ret = eat_whitespace(&t, &curr, &ws_count);
+			line = curr.offset;
+			ret = eat_whitespace(t, &curr, &ws_count);
 			if(!ret) return ret;
 		}
 		if(curr.type == TT_EOF) break;
 		if(skip_conditional_block && !(newline && is_char(&curr, '#'))) continue;
 		if(is_char(&curr, '#')) {
 			if(!newline) {
-				error("stray #", &t, &curr);
+				error("stray #", t, &curr);
 				return 0;
 			}
-			int index = expect(&t, TT_IDENTIFIER, directives, &curr);
+			int index = expect_directive(cpp, t, &curr);
 			if(index == -1) {
 				if(skip_conditional_block) continue;
-				error("invalid preprocessing directive", &t, &curr);
+				error("invalid preprocessing directive", t, &curr);
 				return 0;
 			}
+			switch(index) {
+				case DIR_IF: case DIR_IFDEF: case DIR_IFNDEF:
+				case DIR_ELIF: case DIR_ELSE: case DIR_ENDIF:
+					cond_record(cs, index, line);
+				default: break;
+			}
+			guard_directive(cs, index, if_level);
 			if(skip_conditional_block) switch(index) {
-				case 0: case 1: case 2: case 3: case 4:
-				case 11: case 12:
+				case DIR_INCLUDE: case DIR_ERROR: case DIR_WARNING:
+				case DIR_DEFINE: case DIR_UNDEF: case DIR_LINE: case DIR_PRAGMA:
 					continue;
 				default: break;
 			}
 			switch(index) {
-			case 0:
-				ret = include_file(cpp, &t, out);
+			case DIR_INCLUDE:
+				ret = include_file(cpp, t, out);
 				if(!ret) return ret;
 				break;
-			case 1:
-				ret = emit_error_or_warning(&t, 1);
+			case DIR_ERROR:
+				ret = emit_error_or_warning(t, 1);
 				if(!ret) return ret;
 				break;
-			case 2:
-				ret = emit_error_or_warning(&t, 0);
+			case DIR_WARNING:
+				ret = emit_error_or_warning(t, 0);
 				if(!ret) return ret;
 				break;
-			case 3:
-				ret = parse_macro(cpp, &t);
+			case DIR_DEFINE:
+				ret = parse_macro(cpp, t);
 				if(!ret) return ret;
 				break;
-			case 4:
-				if(!skip_next_and_ws(&t, &curr)) return 0;
+			case DIR_UNDEF:
+				if(!skip_next_and_ws(t, &curr)) return 0;
 				if(curr.type != TT_IDENTIFIER) {
-					error("expected identifier", &t, &curr);
+					error("expected identifier", t, &curr);
 					return 0;
 				}
-				undef_macro(cpp, t.buf);
+				undef_macro(cpp, tok_atom(cpp, &curr, 1));
 				break;
-			case 5: // if
+			case DIR_IF:
 				if(all_levels_active()) {
-					char* visited[MAX_RECURSION] = {0};
-					if(!evaluate_condition(cpp, &t, &ret, visited)) return 0;
-					free_visited(visited);
+					if(!evaluate_condition(cpp, t, &ret)) return 0;
 					set_level(if_level + 1, ret);
 				} else {
 					set_level(if_level + 1, 0);
 				}
 				break;
-			case 6: // elif
+			case DIR_ELIF:
 				if(prev_level_active() && if_level_satisfied < if_level) {
-					char* visited[MAX_RECURSION] = {0};
-					if(!evaluate_condition(cpp, &t, &ret, visited)) return 0;
-					free_visited(visited);
+					if(!evaluate_condition(cpp, t, &ret)) return 0;
 					if(ret) {
 						if_level_active = if_level;
 						if_level_satisfied = if_level;
@@ -1256,7 +2676,7 @@ int parse_file(struct cpp *cpp, FILE *f, const char *fn, FILE *out) {
 					--if_level_active;
 				}
 				break;
-			case 7: // else
+			case DIR_ELSE:
 				if(prev_level_active() && if_level_satisfied < if_level) {
 					if(1) {
 						if_level_active = if_level;
@@ -1266,11 +2686,15 @@ int parse_file(struct cpp *cpp, FILE *f, const char *fn, FILE *out) {
 					--if_level_active;
 				}
 				break;
-			case 8: // ifdef
-			case 9: // ifndef
-				if(!skip_next_and_ws(&t, &curr) || curr.type == TT_EOF) return 0;
-				ret = !!get_macro(cpp, t.buf);
-				if(index == 9) ret = !ret;
+			case DIR_IFDEF:
+			case DIR_IFNDEF:
+				if(!skip_next_and_ws(t, &curr) || curr.type == TT_EOF) return 0;
+				if(cs->guard_state == GUARD_IN && !cs->guard) {
+					if(curr.type == TT_IDENTIFIER) cs->guard = tok_atom(cpp, &curr, 1);
+					else cs->guard_state = GUARD_NONE;
+				}
+				ret = !!tok_macro(cpp, &curr);
+				if(index == DIR_IFNDEF) ret = !ret;
 
 				if(all_levels_active()) {
 					set_level(if_level + 1, ret);
@@ -1278,20 +2702,20 @@ int parse_file(struct cpp *cpp, FILE *f, const char *fn, FILE *out) {
 					set_level(if_level + 1, 0);
 				}
 				break;
-			case 10: // endif
+			case DIR_ENDIF:
 				set_level(if_level-1, -1);
 				break;
-			case 11: // line
-				ret = tokenizer_read_until(&t, "\n", 1);
+			case DIR_LINE:
+				ret = tokenizer_read_until(t, "\n", 1, &curr);
 				if(!ret) {
-					error("unknown", &t, &curr);
+					error("unknown", t, &curr);
 					return 0;
 				}
 				break;
-			case 12: // pragma
+			case DIR_PRAGMA:
 				emit(out, "#pragma");
-				while((ret = x_tokenizer_next(&t, &curr)) && curr.type != TT_EOF) {
-					emit_token(out, &curr, t.buf);
+				while((ret = x_tokenizer_next(t, &curr)) && curr.type != TT_EOF) {
+					emit_token(out, &curr);
 					if(is_char(&curr, '\n')) break;
 				}
 				if(!ret) return ret;
@@ -1299,54 +2723,146 @@ int parse_file(struct cpp *cpp, FILE *f, const char *fn, FILE *out) {
 			default:
 				break;
 			}
+			/* a block known to end further on is jumped over */
+			if(skip_conditional_block && (to = cond_jump(cs, line)) != -1) {
+				/* the input ends before the line, treat it as EOF */
+				if(!tokenizer_seek(t, to)) break;
+				++cpp->cond_jumps;
+			}
 			continue;
 		} else {
-			while(ws_count) {
-				emit(out, " ");
-				--ws_count;
-			}
+			guard_token(cs, &curr, ws_count);
+			flush_whitespace(out, &ws_count);
 		}
 #if DEBUG
-		dprintf(2, "(stdin:%u,%u) ", curr.line, curr.column);
+		unsigned line, column;
+		tokenizer_locate(t, curr.offset, &line, &column);
+		dprintf(2, "(stdin:%u,%u) ", line, column);
 		if(curr.type == TT_SEP)
 			dprintf(2, "separator: %c\n", curr.value == '\n'? ' ' : curr.value);
 		else
-			dprintf(2, "%s: %s\n", tokentype_to_str(curr.type), t.buf);
+			dprintf(2, "%s: %.*s\n", tokentype_to_str(curr.type), (int) curr.len, curr.str);
 #endif
-		if(curr.type == TT_IDENTIFIER) {
-			char* visited[MAX_RECURSION] = {0};
-			if(!expand_macro(cpp, &t, out, t.buf, 0, visited))
+		struct atom *a;
+		if(curr.type == TT_IDENTIFIER && (a = tok_atom(cpp, &curr, 0)) && a->macro) {
+			struct toklist l = {0};
+			struct htok ht = {.tok = curr, .atom = a};
+			ht.tok.str = a->name;
+			if(!expand_macro(cpp, t, &ht, &l))
 				return 0;
-			free_visited(visited);
+			emit_tokens(out, &l);
+			pool_reset(cpp);
 		} else {
-			emit_token(out, &curr, t.buf);
+			emit_token(out, &curr);
 		}
 	}
 	if(if_level) {
-		error("unterminated #if", &t, &curr);
+		error("unterminated #if", t, &curr);
 		return 0;
 	}
 	return 1;
 }
 
+/* read the file f, named fn, included as h if it is */
+static int parse_file(struct cpp *cpp, FILE *f, const char *fn, FILE *out, struct header *h) {
+	struct tokenizer t;
+	tokenizer_init(&t, f, TF_PARSE_STRINGS|TF_WHITESPACE_RUNS);
+	tokenizer_set_filename(&t, fn);
+	tokenizer_register_marker(&t, MT_MULTILINE_COMMENT_START, "/*"); /**/
+	tokenizer_register_marker(&t, MT_MULTILINE_COMMENT_END, "*/");
+	tokenizer_register_marker(&t, MT_SINGLELINE_COMMENT_START, "//");
+	if(cpp->lex_threads) tokenizer_prelex(&t, cpp->lex_threads);
+	/* only regular files read from the start can be told apart */
+	struct stat st;
+	struct cond_scan cs = {.guard_state = h ? GUARD_BEFORE : GUARD_NONE};
+	int indexed = !fstat(fileno(f), &st) && S_ISREG(st.st_mode) && !tokenizer_ftello(&t);
+	if(indexed) file_index_start(cpp, &st, &cs);
+	const char *cond_file = cpp->cond_file;
+	unsigned cond_fhash = cpp->cond_fhash;
+	/* the position of the last expansion mustn't outlive t */
+	const char *last_file = cpp->last_file;
+	struct tokenizer *last_t = cpp->last_t;
+	off_t last_off = cpp->last_off;
+	cond_enter(cpp, fn);
+	int ret = parse_tokens(cpp, &t, out, &cs);
+	if(ret && cs.record && !cs.open.count) file_index_store(cpp, &st, &cs);
+	if(h) {
+		h->guard = ret && cs.guard_state == GUARD_AFTER ? cs.guard : 0;
+		h->outside_len = tglist_getsize(&cs.outside);
+		if(h->outside_len) h->outside = arena_dup(cpp, cs.outside.items, h->outside_len);
+	}
+	tglist_free_items(&cs.found);
+	tglist_free_items(&cs.open);
+	tglist_free_items(&cs.outside);
+	cpp->cond_file = cond_file;
+	cpp->cond_fhash = cond_fhash;
+	cpp->last_file = last_file;
+	cpp->last_t = last_t;
+	cpp->last_off = last_off;
+	tokenizer_fini(&t);
+	return ret;
+}
+
 struct cpp * cpp_new(void) {
 	struct cpp* ret = calloc(1, sizeof(struct cpp));
 	if(!ret) return ret;
 	tglist_init(&ret->includedirs);
 	cpp_add_includedir(ret, ".");
-	ret->macros = hbmap_new(strptrcmp, string_hash, 128);
-	struct macro m = {.num_args = 1};
-	add_macro(ret, strdup("defined"), &m);
-	m.num_args = MACRO_FLAG_OBJECTLIKE;
-	add_macro(ret, strdup("__FILE__"), &m);
-	add_macro(ret, strdup("__LINE__"), &m);
+	struct atom *a = intern(ret, "defined");
+	a->builtin = BI_DEFINED;
+	add_macro(ret, a, 1, 0);
+	a = intern(ret, "__FILE__");
+	a->builtin = BI_FILE;
+	add_macro(ret, a, MACRO_FLAG_OBJECTLIKE, 0);
+	a = intern(ret, "__LINE__");
+	a->builtin = BI_LINE;
+	add_macro(ret, a, MACRO_FLAG_OBJECTLIKE, 0);
+	int i;
+	for(i = DIR_NONE + 1; i <= DIR_MAX; ++i)
+		intern(ret, directive_names[i])->directive = i;
 	return ret;
 }
 
 void cpp_free(struct cpp*cpp) {
 	free_macros(cpp);
+	file_index_free(cpp);
+	header_free(cpp);
+	pool_free(cpp);
+	free(cpp->ctx);
+	free(cpp->frames);
 	tglist_free_values(&cpp->includedirs);
 	tglist_free_items(&cpp->includedirs);
+	free(cpp);
+}
+
+/* lex large input files ahead on this many threads, 0 to disable */
+void cpp_set_lex_threads(struct cpp *cpp, int n) {
+	cpp->lex_threads = n;
+}
+
+void cpp_get_stats(struct cpp *cpp, struct cpp_stats *st) {
+	size_t i, probe, total = 0;
+	*st = (struct cpp_stats) {
+		.names = cpp->atom_count, .slots = cpp->atom_cap,
+		.lookups = cpp->atom_lookups, .probes = cpp->atom_probes,
+		.bodies = cpp->body_count,
+		.memo_hits = cpp->memo_hits, .memo_misses = cpp->memo_misses,
+		.cond_hits = cpp->cond_hits, .cond_misses = cpp->cond_misses,
+		.cond_jumps = cpp->cond_jumps, .guard_skips = cpp->guard_skips,
+		.bytes = cpp->arena_size +
+			cpp->atom_cap * (sizeof *cpp->atom_hash + sizeof *cpp->atom_slot) +
+			cpp->body_cap * sizeof *cpp->body_slot };
+	for(i = 0; i < cpp->atom_cap; ++i) {
+		if(!cpp->atom_hash[i]) continue;
+		struct atom *a = cpp->atom_slot[i];
+		if(a->macro) ++st->macros;
+		probe = ((i - a->hash) & (cpp->atom_cap - 1)) + 1;
+		if(probe > 1) ++st->collisions;
+		if(probe > st->max_probe) st->max_probe = probe;
+		total += probe;
+	}
+	if(st->slots) st->load_factor = (double) st->names / st->slots;
+	if(st->names) st->avg_probe = (double) total / st->names;
 }
 
 void cpp_add_includedir(struct cpp *cpp, const char* includedir) {
@@ -1354,16 +2870,25 @@ void cpp_add_includedir(struct cpp *cpp, const char* includedir) {
 }
 
 int cpp_add_define(struct cpp *cpp, const char *mdecl) {
-	struct FILE_container tmp = {0};
-	tmp.f = open_memstream(&tmp.buf, &tmp.len);
-	fprintf(tmp.f, "%s\n", mdecl);
-	tmp.f = freopen_r(tmp.f, &tmp.buf, &tmp.len);
-	tokenizer_from_file(&tmp.t, tmp.f);
-	int ret = parse_macro(cpp, &tmp.t);
-	free_file_container(&tmp);
+	/* parse_macro() reads the line up to its newline */
+	size_t len = strlen(mdecl);
+	char *buf = malloc(len + 1);
+	if(!buf) return 0;
+	memcpy(buf, mdecl, len);
+	buf[len] = '\n';
+	struct tokenizer t;
+	tokenizer_init_buffer(&t, buf, len + 1, TF_PARSE_STRINGS|TF_WHITESPACE_RUNS);
+	tokenizer_set_filename(&t, "<macro>");
+	int ret = parse_macro(cpp, &t);
+	tokenizer_fini(&t);
+	free(buf);
 	return ret;
 }
 
 int cpp_run(struct cpp *cpp, FILE* in, FILE* out, const char* inname) {
-	return parse_file(cpp, in, inname, out);
+	/* the files may have changed since the last run */
+	cond_free(cpp);
+	file_index_free(cpp);
+	header_free(cpp);
+	return parse_file(cpp, in, inname, out, 0);
 }
@@ -5,10 +5,33 @@
 
 struct cpp;
 
+/* statistics of the macro table, see cpp_get_stats() */
+struct cpp_stats {
+	size_t macros;		/* currently defined */
+	size_t names;		/* entries: macro, parameter and directive names */
+	size_t slots;
+	double load_factor;
+	size_t collisions;	/* entries not stored in their home slot */
+	double avg_probe;	/* mean slots visited finding an entry */
+	size_t max_probe;
+	size_t lookups;		/* lookups done so far, hits or misses */
+	size_t probes;		/* the slots these visited */
+	size_t bodies;		/* distinct macro bodies, shared by the macros */
+	size_t bytes;		/* memory holding the names, macros and bodies */
+	size_t memo_hits;	/* top-level expansions replayed */
+	size_t memo_misses;	/* and those expanded anew */
+	size_t cond_hits;	/* #if and #elif results reused */
+	size_t cond_misses;	/* and those evaluated */
+	size_t cond_jumps;	/* inactive blocks jumped over, see parse_file() */
+	size_t guard_skips;	/* #includes of guarded headers skipped */
+};
+
 struct cpp *cpp_new(void);
 void cpp_free(struct cpp*);
 void cpp_add_includedir(struct cpp *cpp, const char* includedir);
 int cpp_add_define(struct cpp *cpp, const char *mdecl);
+void cpp_set_lex_threads(struct cpp *cpp, int n);
+void cpp_get_stats(struct cpp *cpp, struct cpp_stats *st);
 int cpp_run(struct cpp *cpp, FILE* in, FILE* out, const char* inname);
 
 #ifdef __GNUC__
@@ -0,0 +1,242 @@
+/* tokenizer microbenchmark.
+   feeds generated corpora (or the files given on the command line)
+   through tokenizer_next() with the settings the preprocessor uses, and
+   reports throughput per corpus and a breakdown by token class.
+   the per-class figures come from a separate pass timing every call,
+   so they include the timer overhead; time spent skipping comments is
+   billed to the token following them. the asm corpus is lexed with #
+   as its line comment marker, like an assembler's preprocessor would. */
+
+#include "tokenizer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC
+static uint64_t cycles(void) { return __rdtsc(); }
+#else
+static uint64_t cycles(void) { return 0; }
+#endif
+
+#define CORPUS_SIZE (8*1024*1024)
+#define RUNS 5
+
+enum tokclass { TC_IDENT, TC_NUMBER, TC_STRING, TC_BLANK, TC_NEWLINE, TC_PUNCT, TC_OTHER, TC_MAX };
+static const char *tokclass_names[TC_MAX] = {
+	"identifier", "number", "string", "whitespace", "newline", "punctuation", "other",
+};
+
+static enum tokclass classify(const struct token *tok) {
+	switch((unsigned) tok->type) {
+	case TT_IDENTIFIER: return TC_IDENT;
+	case TT_HEX_INT_LIT: case TT_OCT_INT_LIT: case TT_DEC_INT_LIT: case TT_FLOAT_LIT:
+		return TC_NUMBER;
+	case TT_SQSTRING_LIT: case TT_DQSTRING_LIT: case TT_WIDECHAR_LIT: case TT_WIDESTRING_LIT:
+		return TC_STRING;
+	case TT_SEP:
+		if(tok->value == ' ' || tok->value == '\t') return TC_BLANK;
+		if(tok->value == '\n') return TC_NEWLINE;
+		return TC_PUNCT;
+	}
+	return TC_OTHER;
+}
+
+static unsigned rnd(void) {
+	static unsigned long long s = 0x9e3779b97f4a7c15ULL;
+	s ^= s << 13; s ^= s >> 7; s ^= s << 17;
+	return s >> 11;
+}
+
+static const char *words[] = {
+	"static", "inline", "unsigned", "const", "struct", "return", "buffer_length",
+	"ptr", "node_next", "tokenizer_state", "i", "count", "hash_value", "x86_register",
+	"CONFIG_ENABLE_FEATURE", "memcpy", "size_t", "uint32_t", "do_something_useful",
+};
+#define WORD() words[rnd() % (sizeof words / sizeof words[0])]
+
+static void gen_idents(FILE *f) {
+	while(ftell(f) < CORPUS_SIZE)
+		fprintf(f, "%s %s %s_%u(%s *%s, %s %s) { return %s->%s + %s; }\n",
+			WORD(), WORD(), WORD(), rnd() % 1000, WORD(), WORD(), WORD(), WORD(),
+			WORD(), WORD(), WORD());
+}
+
+static void gen_comments(FILE *f) {
+	while(ftell(f) < CORPUS_SIZE) {
+		unsigned i, n = 2 + rnd() % 8;
+		fprintf(f, "/*\n");
+		for(i = 0; i < n; ++i)
+			fprintf(f, " * %s %s %s %s, %s %s %s.\n", WORD(), WORD(), WORD(), WORD(), WORD(), WORD(), WORD());
+		fprintf(f, " */\nextern int %s_%u; // %s %s %s\n", WORD(), rnd() % 1000, WORD(), WORD(), WORD());
+	}
+}
+
+static void gen_numbers(FILE *f) {
+	while(ftell(f) < CORPUS_SIZE)
+		fprintf(f, "{ 0x%08x, %u, 0%o, %u.%ue%+df, %uUL, .%u },\n",
+			rnd(), rnd() % 100000, rnd() % 4096, rnd() % 100, rnd() % 1000,
+			(int) (rnd() % 60) - 30, rnd(), rnd() % 100);
+}
+
+static void gen_strings(FILE *f) {
+	while(ftell(f) < CORPUS_SIZE) {
+		unsigned i, n = 4 + rnd() % 24;
+		fprintf(f, "const char *msg_%u = \"", rnd() % 1000);
+		for(i = 0; i < n; ++i)
+			fprintf(f, "%s%s ", WORD(), rnd() % 8 ? "" : "\\\"\\n");
+		fprintf(f, "\";\n'%c', L\"%s\";\n", 'a' + rnd() % 26, WORD());
+	}
+}
+
+static void gen_asm(FILE *f) {
+	static const char *ops[] = { "movl", "addl", "leaq", "cmpq", "jne", "pushq", "xorl" };
+	static const char *regs[] = { "%eax", "%ebx", "%rcx", "%rdx", "%rsi", "%r8", "%rsp" };
+	while(ftell(f) < CORPUS_SIZE)
+		fprintf(f, "%s\t%-8s\t%s,%*s%u(%s)\t\t# %s %s\n",
+			rnd() % 4 ? "" : "label:",
+			ops[rnd() % 7], regs[rnd() % 7], (int) (rnd() % 6), "",
+			rnd() % 256, regs[rnd() % 7], WORD(), WORD());
+}
+
+struct corpus {
+	const char *name;
+	void (*gen)(FILE *);
+	const char *line_comment;
+};
+
+static const struct corpus corpora[] = {
+	{ "identifiers", gen_idents, "//" },
+	{ "comments", gen_comments, "//" },
+	{ "numbers", gen_numbers, "//" },
+	{ "strings", gen_strings, "//" },
+	{ "asm (# cmt)", gen_asm, "#" },
+};
+
+struct classstat {
+	unsigned long long tokens, bytes, cycles;
+	double secs;
+};
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void setup(struct tokenizer *t, FILE *f, const char *line_comment) {
+	tokenizer_init(t, f, TF_PARSE_STRINGS|TF_WHITESPACE_RUNS);
+	tokenizer_register_marker(t, MT_MULTILINE_COMMENT_START, "/*");
+	tokenizer_register_marker(t, MT_MULTILINE_COMMENT_END, "*/");
+	tokenizer_register_marker(t, MT_SINGLELINE_COMMENT_START, line_comment);
+}
+
+/* one pass over t, returns the number of tokens */
+static unsigned long long run(struct tokenizer *t, struct classstat *cs) {
+	unsigned long long n = 0;
+	struct token tok;
+	tokenizer_rewind(t);
+	while(1) {
+		double t0 = cs ? now() : 0;
+		uint64_t c0 = cs ? cycles() : 0;
+		tokenizer_next(t, &tok);
+		if(tok.type == TT_EOF) break;
+		if(cs) {
+			struct classstat *s = &cs[classify(&tok)];
+			s->cycles += cycles() - c0;
+			s->secs += now() - t0;
+			s->tokens++;
+			s->bytes += tok.len;
+		}
+		++n;
+	}
+	return n;
+}
+
+static void bench(const char *name, FILE *f, const char *line_comment, struct classstat *total) {
+	struct tokenizer t;
+	struct classstat cs[TC_MAX] = {{0}};
+	double best = 0;
+	uint64_t best_cyc = 0;
+	unsigned long long ntok = 0;
+	int i;
+
+	fseek(f, 0, SEEK_END);
+	double size = ftell(f);
+	rewind(f);
+	setup(&t, f, line_comment);
+	for(i = 0; i < RUNS; ++i) {
+		double t0 = now();
+		uint64_t c0 = cycles();
+		ntok = run(&t, 0);
+		uint64_t c = cycles() - c0;
+		double d = now() - t0;
+		if(!i || d < best) {
+			best = d;
+			best_cyc = c;
+		}
+	}
+	run(&t, cs);
+	tokenizer_fini(&t);
+
+	printf("%-14s %8.2f %9.1f %9.2f", name, size / 1e6, size / 1e6 / best, ntok / 1e6 / best);
+#ifdef HAVE_TSC
+	printf(" %8.2f\n", best_cyc / size);
+#else
+	(void) best_cyc;
+	printf(" %8s\n", "-");
+#endif
+	for(i = 0; i < TC_MAX; ++i) {
+		total[i].tokens += cs[i].tokens;
+		total[i].bytes += cs[i].bytes;
+		total[i].cycles += cs[i].cycles;
+		total[i].secs += cs[i].secs;
+	}
+}
+
+int main(int argc, char **argv) {
+	struct classstat total[TC_MAX] = {{0}};
+	size_t i;
+	int arg;
+
+	printf("%-14s %8s %9s %9s %8s\n", "corpus", "MB", "MB/s", "Mtok/s", "cyc/B");
+	if(argc > 1) {
+		for(arg = 1; arg < argc; ++arg) {
+			FILE *f = fopen(argv[arg], "r");
+			if(!f) {
+				perror(argv[arg]);
+				return 1;
+			}
+			bench(argv[arg], f, "//", total);
+			fclose(f);
+		}
+	} else for(i = 0; i < sizeof corpora / sizeof corpora[0]; ++i) {
+		/* a regular file, so that the tokenizer maps it */
+		FILE *f = tmpfile();
+		if(!f) {
+			perror("tmpfile");
+			return 1;
+		}
+		corpora[i].gen(f);
+		fflush(f);
+		bench(corpora[i].name, f, corpora[i].line_comment, total);
+		fclose(f);
+	}
+
+	printf("\n%-14s %10s %10s %9s %9s %8s\n", "class", "tokens", "bytes", "MB/s", "Mtok/s", "cyc/B");
+	for(i = 0; i < TC_MAX; ++i) {
+		if(!total[i].tokens) continue;
+		printf("%-14s %10llu %10llu %9.1f %9.2f", tokclass_names[i],
+			total[i].tokens, total[i].bytes,
+			total[i].bytes / 1e6 / total[i].secs,
+			total[i].tokens / 1e6 / total[i].secs);
+#ifdef HAVE_TSC
+		printf(" %8.2f\n", total[i].bytes ? (double) total[i].cycles / total[i].bytes : 0.0);
+#else
+		printf(" %8s\n", "-");
+#endif
+	}
+	return 0;
+}
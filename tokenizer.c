@@ -3,9 +3,124 @@
 #include <ctype.h>
 #include <string.h>
 #include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
 
 #include "tokenizer.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define TOKENIZER_X86_SIMD
+#endif
+
+/* scanning kernels. they return a pointer to the first byte in [p, e)
+   that is equal to one of a, b and c (scan3), or that isn't part of
+   an identifier (scan_ident), or e if there is none. */
+static const char *scan3_scalar(const char *p, const char *e, int a, int b, int c) {
+	for(; p < e; ++p) {
+		int x = (unsigned char) *p;
+		if(x == a || x == b || x == c) break;
+	}
+	return p;
+}
+
+static int is_ident_char(int c) {
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+	       (c >= '0' && c <= '9') || c == '_';
+}
+
+static const char *scan_ident_scalar(const char *p, const char *e) {
+	while(p < e && is_ident_char((unsigned char) *p)) ++p;
+	return p;
+}
+
+#ifdef TOKENIZER_X86_SIMD
+__attribute__((target("sse2")))
+static const char *scan3_sse2(const char *p, const char *e, int a, int b, int c) {
+	const __m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b), vc = _mm_set1_epi8(c);
+	for(; e - p >= 16; p += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i*) p);
+		__m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(x, va),
+			_mm_cmpeq_epi8(x, vb)), _mm_cmpeq_epi8(x, vc));
+		unsigned mask = _mm_movemask_epi8(m);
+		if(mask) return p + __builtin_ctz(mask);
+	}
+	return scan3_scalar(p, e, a, b, c);
+}
+
+/* bytes >= 128 are negative in the signed compares, so they never
+   fall into one of the ranges. or-ing 0x20 folds A-Z onto a-z. */
+__attribute__((target("sse2")))
+static const char *scan_ident_sse2(const char *p, const char *e) {
+	const __m128i case_bit = _mm_set1_epi8(0x20), us = _mm_set1_epi8('_'),
+		a_lo = _mm_set1_epi8('a'-1), a_hi = _mm_set1_epi8('z'+1),
+		d_lo = _mm_set1_epi8('0'-1), d_hi = _mm_set1_epi8('9'+1);
+	for(; e - p >= 16; p += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i*) p);
+		__m128i l = _mm_or_si128(x, case_bit);
+		__m128i m = _mm_and_si128(_mm_cmpgt_epi8(l, a_lo), _mm_cmplt_epi8(l, a_hi));
+		m = _mm_or_si128(m, _mm_and_si128(_mm_cmpgt_epi8(x, d_lo), _mm_cmplt_epi8(x, d_hi)));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(x, us));
+		unsigned mask = _mm_movemask_epi8(m) ^ 0xffff;
+		if(mask) return p + __builtin_ctz(mask);
+	}
+	return scan_ident_scalar(p, e);
+}
+
+__attribute__((target("avx2")))
+static const char *scan3_avx2(const char *p, const char *e, int a, int b, int c) {
+	const __m256i va = _mm256_set1_epi8(a), vb = _mm256_set1_epi8(b), vc = _mm256_set1_epi8(c);
+	for(; e - p >= 32; p += 32) {
+		__m256i x = _mm256_loadu_si256((const __m256i*) p);
+		__m256i m = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(x, va),
+			_mm256_cmpeq_epi8(x, vb)), _mm256_cmpeq_epi8(x, vc));
+		unsigned mask = _mm256_movemask_epi8(m);
+		if(mask) return p + __builtin_ctz(mask);
+	}
+	return scan3_sse2(p, e, a, b, c);
+}
+
+__attribute__((target("avx2")))
+static const char *scan_ident_avx2(const char *p, const char *e) {
+	const __m256i case_bit = _mm256_set1_epi8(0x20), us = _mm256_set1_epi8('_'),
+		a_lo = _mm256_set1_epi8('a'-1), a_hi = _mm256_set1_epi8('z'+1),
+		d_lo = _mm256_set1_epi8('0'-1), d_hi = _mm256_set1_epi8('9'+1);
+	for(; e - p >= 32; p += 32) {
+		__m256i x = _mm256_loadu_si256((const __m256i*) p);
+		__m256i l = _mm256_or_si256(x, case_bit);
+		__m256i m = _mm256_and_si256(_mm256_cmpgt_epi8(l, a_lo), _mm256_cmpgt_epi8(a_hi, l));
+		m = _mm256_or_si256(m, _mm256_and_si256(_mm256_cmpgt_epi8(x, d_lo), _mm256_cmpgt_epi8(d_hi, x)));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(x, us));
+		unsigned mask = ~(unsigned) _mm256_movemask_epi8(m);
+		if(mask) return p + __builtin_ctz(mask);
+	}
+	return scan_ident_sse2(p, e);
+}
+#endif
+
+static const char *(*scan3)(const char*, const char*, int, int, int) = scan3_scalar;
+static const char *(*scan_ident)(const char*, const char*) = scan_ident_scalar;
+
+static void scan_init(void) {
+	static int done;
+	if(done) return;
+#ifdef TOKENIZER_X86_SIMD
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")) {
+		scan3 = scan3_avx2;
+		scan_ident = scan_ident_avx2;
+	} else if(__builtin_cpu_supports("sse2")) {
+		scan3 = scan3_sse2;
+		scan_ident = scan_ident_sse2;
+	}
+#endif
+	done = 1;
+}
+
 void tokenizer_set_filename(struct tokenizer *t, const char* fn) {
 	t->filename = fn;
 }
@@ -13,51 +128,141 @@ void tokenizer_set_filename(struct tokenizer *t, const char* fn) {
 #define ARRAY_SIZE(X) (sizeof(X)/sizeof(X[0]))
 
 off_t tokenizer_ftello(struct tokenizer *t) {
-	return ftello(t->input)-t->getc_buf.buffered;
+	return t->src_off + (t->cur - t->src);
+}
+
+static const char *rebase(const char *p, const char *from, const char *to, const char *nbase) {
+	if(p && p >= from && p <= to) return nbase + (p - from);
+	return p;
+}
+
+/* add the newlines before upto that are still in the window to the index */
+static void nl_index(struct tokenizer *t, off_t upto) {
+	off_t wend = t->src_off + (t->end - t->src);
+	if(upto > wend) upto = wend;
+	if(upto <= t->nl_upto) return;
+	assert(t->nl_upto >= t->src_off);
+	const char *p = t->src + (t->nl_upto - t->src_off), *e = t->src + (upto - t->src_off);
+	while((p = scan3(p, e, '\n', '\n', '\n')) < e) {
+		if(t->nl_count == t->nl_alloc) {
+			size_t n = t->nl_alloc ? t->nl_alloc * 2 : 1024;
+			off_t *q = realloc(t->nl_offs, n * sizeof *q);
+			if(!q) return;
+			t->nl_offs = q;
+			t->nl_alloc = n;
+		}
+		t->nl_offs[t->nl_count++] = t->src_off + (p - t->src);
+		++p;
+	}
+	t->nl_upto = upto;
+}
+
+/* 1-based line and 0-based column of the byte at offset */
+void tokenizer_locate(struct tokenizer *t, off_t offset, unsigned *line, unsigned *column) {
+	nl_index(t, offset);
+	size_t lo = 0, hi = t->nl_count;
+	while(lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if(t->nl_offs[mid] < offset) lo = mid + 1;
+		else hi = mid;
+	}
+	*line = lo + 1;
+	*column = offset - (lo ? t->nl_offs[lo - 1] + 1 : 0);
+}
+
+/* move the input window forward. the last MAX_UNGETC bytes are kept
+   so they can still be pushed back, as well as the spelling of the
+   current token which is handed out as a slice of the window.
+   returns 0 on end of input. */
+static int tokenizer_refill(struct tokenizer *t)
+{
+	if(t->backend != TB_BLOCK || t->input_eof) return 0;
+	const char *keep_from = t->cur - MAX_UNGETC;
+	if(keep_from < t->src) keep_from = t->src;
+	if(t->toklen && !t->spliced && t->tokstart >= t->src && t->tokstart < keep_from)
+		keep_from = t->tokstart;
+	size_t keep = t->cur - keep_from;
+	nl_index(t, t->src_off + (keep_from - t->src));
+	char *nb = t->blk;
+	if(!nb || keep > t->blksize / 2) {
+		size_t size = t->blksize;
+		if(!size) size = t->fd == -1 ? TOKENIZER_STREAM_BLOCK_SIZE : TOKENIZER_BLOCK_SIZE;
+		while(keep > size / 2) size *= 2;
+		nb = malloc(size);
+		if(!nb) return 0;
+		memcpy(nb, keep_from, keep);
+		t->blksize = size;
+	} else
+		memmove(nb, keep_from, keep);
+	t->tokstart = rebase(t->tokstart, keep_from, t->cur, nb);
+	if(nb != t->blk) free(t->blk);
+	t->blk = nb;
+	t->src_off += keep_from - t->src;
+	t->src = t->blk;
+	t->cur = t->end = t->blk + keep;
+
+	ssize_t n;
+	if(t->fd != -1) {
+		do n = read(t->fd, t->blk + keep, t->blksize - keep);
+		while(n == -1 && errno == EINTR);
+	} else
+		n = fread(t->blk + keep, 1, t->blksize - keep, t->input);
+	if(n <= 0) {
+		t->input_eof = 1;
+		return 0;
+	}
+	t->end += n;
+	return 1;
 }
 
 static int tokenizer_ungetc(struct tokenizer *t, int c)
 {
-	++t->getc_buf.buffered;
-	assert(t->getc_buf.buffered<ARRAY_SIZE(t->getc_buf.buf));
-	assert(t->getc_buf.cnt > 0);
-	--t->getc_buf.cnt;
-	assert(t->getc_buf.buf[t->getc_buf.cnt % ARRAY_SIZE(t->getc_buf.buf)] == c);
+	/* reading EOF doesn't advance the cursor */
+	if(c == EOF) return c;
+	assert(t->cur > t->src);
+	--t->cur;
+	assert((unsigned char) *t->cur == c);
 	return c;
 }
 static int tokenizer_getc(struct tokenizer *t)
 {
-	int c;
-	if(t->getc_buf.buffered) {
-		t->getc_buf.buffered--;
-		c = t->getc_buf.buf[(t->getc_buf.cnt) % ARRAY_SIZE(t->getc_buf.buf)];
-	} else {
-		c = getc(t->input);
-		t->getc_buf.buf[t->getc_buf.cnt % ARRAY_SIZE(t->getc_buf.buf)] = c;
-	}
-	++t->getc_buf.cnt;
-	return c;
+	if(t->cur == t->end && !tokenizer_refill(t))
+		return EOF;
+	return (unsigned char) *t->cur++;
 }
 
 int tokenizer_peek(struct tokenizer *t) {
-	if(t->peeking) return t->peek_token.value;
 	int ret = tokenizer_getc(t);
 	if(ret != EOF) tokenizer_ungetc(t, ret);
 	return ret;
 }
 
-int tokenizer_peek_token(struct tokenizer *t, struct token *tok) {
-	int ret = tokenizer_next(t, tok);
-	t->peek_token = *tok;
-	t->peeking = 1;
-	return ret;
+static void prelex_stop(struct tokenizer *t);
+
+#define LEAD_SET(BM, C) ((BM)[(C) >> 5] |= 1U << ((C) & 31))
+#define LEAD_TEST(BM, C) (((BM)[(C) >> 5] >> ((C) & 31)) & 1)
+
+static void build_custom_table(struct tokenizer *t) {
+	int i;
+	memset(t->custom_lead, 0, sizeof t->custom_lead);
+	memset(t->custom_head, 0, sizeof t->custom_head);
+	for(i = t->custom_count - 1; i >= 0; --i) {
+		const char *p = t->custom_tokens[i];
+		if(!p || !p[0]) continue;
+		int c = (unsigned char) p[0];
+		LEAD_SET(t->custom_lead, c);
+		t->custom_next[i] = t->custom_head[c];
+		t->custom_head[c] = i + 1;
+	}
 }
 
 void tokenizer_register_custom_token(struct tokenizer*t, int tokentype, const char* str) {
 	assert(tokentype >= TT_CUSTOM && tokentype < TT_CUSTOM + MAX_CUSTOM_TOKENS);
 	int pos = tokentype - TT_CUSTOM;
+	prelex_stop(t);
 	t->custom_tokens[pos] = str;
 	if(pos+1 > t->custom_count) t->custom_count = pos+1;
+	build_custom_table(t);
 }
 
 const char* tokentype_to_str(enum tokentype tt) {
@@ -74,165 +279,233 @@ const char* tokentype_to_str(enum tokentype tt) {
 		case TT_FLOAT_LIT: return "float";
 		case TT_SEP: return "separator";
 		case TT_UNKNOWN: return "unknown";
-		case TT_OVERFLOW: return "overflow";
 		case TT_EOF: return "eof";
 	}
 	return "????";
 }
 
-static int has_ul_tail(const char *p) {
-	char tail[4];
-	int tc = 0, c;
-	while(tc < 4 ) {
-		if(!*p) break;
-		c = tolower(*p);
-		if(c == 'u' || c == 'l') {
-			tail[tc++] = c;
-		} else {
-			return 0;
-		}
-		p++;
-	}
-	if(tc == 1) return 1;
-	if(tc == 2) {
-		if(!memcmp(tail, "lu", 2)) return 1;
-		if(!memcmp(tail, "ul", 2)) return 1;
-		if(!memcmp(tail, "ll", 2)) return 1;
+/* words are classified by a DFA that is fed each byte as it's appended
+   to the token. its states are the reachable combinations of the states
+   of the small recognizers below - one per token type, plus one tracking
+   whether the word read so far can still become a float - so every byte
+   is looked at once, no matter how many types are still possible. */
+enum charclass {
+	CC_OTHER, CC_ZERO, CC_OCT, CC_DEC, CC_X, CC_U, CC_L, CC_E, CC_F,
+	CC_HEX, CC_ALPHA, CC_DOT, CC_SIGN, CC_MAX
+};
+
+static unsigned char char_class[256];
+
+static void char_class_init(void) {
+	int c;
+	for(c = 0; c < 256; ++c) {
+		int l = tolower(c);
+		if(c & 128) char_class[c] = CC_OTHER;
+		else if(c == '0') char_class[c] = CC_ZERO;
+		else if(c >= '1' && c <= '7') char_class[c] = CC_OCT;
+		else if(c == '8' || c == '9') char_class[c] = CC_DEC;
+		else if(l == 'x') char_class[c] = CC_X;
+		else if(l == 'u') char_class[c] = CC_U;
+		else if(l == 'l') char_class[c] = CC_L;
+		else if(l == 'e') char_class[c] = CC_E;
+		else if(l == 'f') char_class[c] = CC_F;
+		else if(l >= 'a' && l <= 'd') char_class[c] = CC_HEX;
+		else if(is_ident_char(c)) char_class[c] = CC_ALPHA;
+		else if(c == '.') char_class[c] = CC_DOT;
+		else if(c == '+' || c == '-') char_class[c] = CC_SIGN;
+		else char_class[c] = CC_OTHER;
 	}
-	if(tc == 3) {
-		if(!memcmp(tail, "llu", 3)) return 1;
-		if(!memcmp(tail, "ull", 3)) return 1;
+}
+
+static int cc_digit(int cc) { return cc == CC_ZERO || cc == CC_OCT || cc == CC_DEC; }
+static int cc_hexdigit(int cc) { return cc_digit(cc) || cc == CC_E || cc == CC_F || cc == CC_HEX; }
+static int cc_ident(int cc) { return cc >= CC_ZERO && cc <= CC_ALPHA; }
+
+/* in all recognizers, state 0 is the dead state and 1 the start state. */
+
+/* integer suffix: u, l, ul, lu, ll, ull or llu in any case.
+   all states but 0 accept. */
+enum { SFX_U = 1, SFX_L, SFX_UL, SFX_LU, SFX_LL, SFX_END, SFX_MAX };
+static int sfx_start(int cc) {
+	return cc == CC_U ? SFX_U : cc == CC_L ? SFX_L : 0;
+}
+static int sfx_step(int s, int cc) {
+	switch(s) {
+	case SFX_U:  return cc == CC_L ? SFX_UL : 0;
+	case SFX_L:  return cc == CC_U ? SFX_LU : cc == CC_L ? SFX_LL : 0;
+	case SFX_UL: return cc == CC_L ? SFX_END : 0;
+	case SFX_LL: return cc == CC_U ? SFX_END : 0;
 	}
 	return 0;
 }
 
-static int is_hex_int_literal(const char *s) {
-	if(s[0] == '-') s++;
-	if(s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
-		const char* p = s+2;
-		while(*p) {
-			if(!strchr("0123456789abcdef", tolower(*p))) {
-				if(p == s+2) return 0;
-				return has_ul_tail(p);
-			}
-			p++;
-		}
-		return 1;
+enum { HX_ZERO = 2, HX_X, HX_DIGITS, HX_SFX };
+static int hex_step(int s, int cc) {
+	switch(s) {
+	case 1: return cc == CC_ZERO ? HX_ZERO : 0;
+	case HX_ZERO: return cc == CC_X ? HX_X : 0;
+	case HX_X: return cc_hexdigit(cc) ? HX_DIGITS : 0;
+	case HX_DIGITS:
+		if(cc_hexdigit(cc)) return HX_DIGITS;
+		s = sfx_start(cc);
+		return s ? HX_SFX + s : 0;
 	}
+	if(s > HX_SFX && (s = sfx_step(s - HX_SFX, cc))) return HX_SFX + s;
 	return 0;
 }
+static int hex_accepts(int s) { return s >= HX_X; }
 
-static int is_plus_or_minus(int c) {
-	return c == '-' || c == '+';
+/* a leading 0 can only be followed by a suffix, otherwise it's octal */
+enum { DC_ZERO = 2, DC_DIGITS, DC_SFX };
+static int dec_step(int s, int cc) {
+	switch(s) {
+	case 1:
+		if(cc == CC_ZERO) return DC_ZERO;
+		return cc_digit(cc) ? DC_DIGITS : 0;
+	case DC_DIGITS:
+		if(cc_digit(cc)) return DC_DIGITS;
+		/* fall through */
+	case DC_ZERO:
+		s = sfx_start(cc);
+		return s ? DC_SFX + s : 0;
+	}
+	if(s > DC_SFX && (s = sfx_step(s - DC_SFX, cc))) return DC_SFX + s;
+	return 0;
 }
+static int dec_accepts(int s) { return s >= DC_ZERO; }
 
-static int is_dec_int_literal(const char *str) {
-	const char *s = str;
-	if(is_plus_or_minus(s[0])) s++;
-	if(s[0] == '0') {
-		if(s[1] == 0) return 1;
-		if(isdigit(s[1])) return 0;
-	}
-	while(*s) {
-		if(!isdigit(*s)) {
-			if(s > str && (is_plus_or_minus(str[0]) ? s > str+1 : 1)) return has_ul_tail(s);
-			else return 0;
-		}
-		s++;
-	}
-	return 1;
+static int oct_step(int s, int cc) {
+	if(s == 1) return cc == CC_ZERO ? 2 : 0;
+	return s && (cc == CC_ZERO || cc == CC_OCT) ? 2 : 0;
 }
+static int oct_accepts(int s) { return s == 2; }
 
-static int is_float_literal(const char *str) {
-	const char *s = str;
-	if(is_plus_or_minus(s[0])) s++;
-	int got_dot = 0, got_e = 0, got_digits = 0;
-	while(*s) {
-		int l = tolower(*s);
-		if(*s == '.') {
-			if(got_dot) return 0;
-			got_dot = 1;
-		} else if(l == 'f') {
-			if(s[1] == 0 && (got_dot || got_e) && got_digits) return 1;
-			return 0;
-		} else if (isdigit(*s)) {
-			got_digits = 1;
-		} else if(l == 'e') {
-			if(!got_digits) return 0;
-			s++;
-			if(is_plus_or_minus(*s)) s++;
-			if(!isdigit(*s)) return 0;
-			got_e = 1;
+/* floats: digits with at most one dot and any number of exponents,
+   each of which needs a digit after its optional sign, and an optional
+   trailing f. states are 1 + mode << 3 | flags. */
+enum { FL_DOT = 1, FL_DIGITS = 2, FL_EXP = 4 };
+enum { FM_BODY, FM_EXP, FM_EXP_SIGN, FM_SUFFIX };
+static int flt_step(int s, int cc) {
+	if(!s) return 0;
+	int mode = (s - 1) >> 3, fl = (s - 1) & 7;
+	switch(mode) {
+	case FM_BODY:
+		if(cc == CC_DOT) {
+			if(fl & FL_DOT) return 0;
+			fl |= FL_DOT;
+		} else if(cc == CC_F) {
+			if(!((fl & (FL_DOT|FL_EXP)) && (fl & FL_DIGITS))) return 0;
+			mode = FM_SUFFIX;
+		} else if(cc_digit(cc)) fl |= FL_DIGITS;
+		else if(cc == CC_E) {
+			if(!(fl & FL_DIGITS)) return 0;
+			mode = FM_EXP;
 		} else return 0;
-		s++;
+		break;
+	case FM_EXP:
+		if(cc == CC_SIGN) {
+			mode = FM_EXP_SIGN;
+			break;
+		}
+		/* fall through */
+	case FM_EXP_SIGN:
+		if(!cc_digit(cc)) return 0;
+		mode = FM_BODY;
+		fl |= FL_EXP;
+		break;
+	default:
+		return 0;
 	}
-	if(got_digits && (got_e || got_dot)) return 1;
-	return 0;
+	return 1 + (mode << 3 | fl);
+}
+static int flt_accepts(int s) {
+	if(!s) return 0;
+	int mode = (s - 1) >> 3, fl = (s - 1) & 7;
+	if(mode == FM_SUFFIX) return 1;
+	return mode == FM_BODY && (fl & FL_DIGITS) && (fl & (FL_DOT|FL_EXP));
 }
 
-static int is_valid_float_until(const char*s, const char* until) {
-	int got_digits = 0, got_dot = 0;
-	while(s < until) {
-		if(isdigit(*s)) got_digits = 1;
-		else if(*s == '.') {
-			if(got_dot) return 0;
-			got_dot = 1;
-		} else return 0;
-		++s;
-	}
-	return got_digits | (got_dot << 1);
+static int idn_step(int s, int cc) {
+	if(s == 1) return cc_ident(cc) && !cc_digit(cc) ? 2 : 0;
+	return s && cc_ident(cc) ? 2 : 0;
 }
+static int idn_accepts(int s) { return s == 2; }
 
-static int is_oct_int_literal(const char *s) {
-	if(s[0] == '-') s++;
-	if(s[0] != '0') return 0;
-	while(*s) {
-		if(!strchr("01234567", *s)) return 0;
-		s++;
-	}
-	return 1;
+/* whether the word so far is digits and at most one dot, which decides
+   if a following '.', or a sign after an e, still belongs to the word.
+   value is got_digits | got_dot << 1. */
+enum { FP_DIGITS = 2, FP_DOT, FP_BOTH };
+static int fp_step(int s, int cc) {
+	if(cc_digit(cc)) return s == 1 || s == FP_DIGITS ? FP_DIGITS : s ? FP_BOTH : 0;
+	if(cc == CC_DOT) return s == 1 ? FP_DOT : s == FP_DIGITS ? FP_BOTH : 0;
+	return 0;
 }
+static int fp_value(int s) { return s > 1 ? s - 1 : 0; }
 
-static int is_identifier(const char *s) {
-	static const char ascmap[128] = {
-	['0'] = 2, ['1'] = 2, ['2'] = 2, ['3'] = 2,
-	['4'] = 2, ['5'] = 2, ['6'] = 2, ['7'] = 2,
-	['8'] = 2, ['9'] = 2, ['A'] = 1, ['B'] = 1,
-	['C'] = 1, ['D'] = 1, ['E'] = 1, ['F'] = 1,
-	['G'] = 1, ['H'] = 1, ['I'] = 1, ['J'] = 1,
-	['K'] = 1, ['L'] = 1, ['M'] = 1, ['N'] = 1,
-	['O'] = 1, ['P'] = 1, ['Q'] = 1, ['R'] = 1,
-	['S'] = 1, ['T'] = 1, ['U'] = 1, ['V'] = 1,
-	['W'] = 1, ['X'] = 1, ['Y'] = 1, ['Z'] = 1,
-	['_'] = 1, ['a'] = 1, ['b'] = 1, ['c'] = 1,
-	['d'] = 1, ['e'] = 1, ['f'] = 1, ['g'] = 1,
-	['h'] = 1, ['i'] = 1, ['j'] = 1, ['k'] = 1,
-	['l'] = 1, ['m'] = 1, ['n'] = 1, ['o'] = 1,
-	['p'] = 1, ['q'] = 1, ['r'] = 1, ['s'] = 1,
-	['t'] = 1, ['u'] = 1, ['v'] = 1, ['w'] = 1,
-	['x'] = 1, ['y'] = 1, ['z'] = 1,
-	};
-	if((*s) & 128) return 0;
-	if(ascmap[(unsigned) *s] != 1) return 0;
-	++s;
-	while(*s) {
-		if((*s) & 128) return 0;
-		if(!ascmap[(unsigned) *s])
-			return 0;
-		s++;
+enum { LX_HEX, LX_DEC, LX_OCT, LX_FLT, LX_IDN, LX_FP, LX_SIGN, LX_PARTS };
+/* flags of a DFA state */
+enum {
+	LXF_DOT_OK = 1,   /* a '.' continues the word */
+	LXF_SIGN_OK = 2,  /* a '+' or '-' continues the word */
+	LXF_IDENT_RUN = 4,/* identifier characters don't change the state */
+};
+#define LX_MAX_STATES 128
+static unsigned char lex_next[LX_MAX_STATES][CC_MAX];
+static unsigned char lex_flags[LX_MAX_STATES];
+static unsigned char lex_type[LX_MAX_STATES];
+
+static void lex_dfa_init(void) {
+	static unsigned char parts[LX_MAX_STATES][LX_PARTS];
+	static int done;
+	int n = 1, i, j, cc;
+	if(done) return;
+	done = 1;
+	char_class_init();
+	for(j = 0; j < LX_SIGN; ++j) parts[0][j] = 1;
+	parts[0][LX_SIGN] = 0;
+	for(i = 0; i < n; ++i) {
+		const unsigned char *p = parts[i];
+		for(cc = 0; cc < CC_MAX; ++cc) {
+			unsigned char q[LX_PARTS] = {
+				[LX_HEX] = hex_step(p[LX_HEX], cc),
+				[LX_DEC] = dec_step(p[LX_DEC], cc),
+				[LX_OCT] = oct_step(p[LX_OCT], cc),
+				[LX_FLT] = flt_step(p[LX_FLT], cc),
+				[LX_IDN] = idn_step(p[LX_IDN], cc),
+				[LX_FP] = fp_step(p[LX_FP], cc),
+				[LX_SIGN] = cc == CC_E && fp_value(p[LX_FP]),
+			};
+			for(j = 0; j < n && memcmp(parts[j], q, LX_PARTS); ++j);
+			if(j == n) {
+				assert(n < LX_MAX_STATES);
+				memcpy(parts[n++], q, LX_PARTS);
+			}
+			lex_next[i][cc] = j;
+		}
+	}
+	for(i = 0; i < n; ++i) {
+		const unsigned char *p = parts[i];
+		if(hex_accepts(p[LX_HEX])) lex_type[i] = TT_HEX_INT_LIT;
+		else if(dec_accepts(p[LX_DEC])) lex_type[i] = TT_DEC_INT_LIT;
+		else if(oct_accepts(p[LX_OCT])) lex_type[i] = TT_OCT_INT_LIT;
+		else if(flt_accepts(p[LX_FLT])) lex_type[i] = TT_FLOAT_LIT;
+		else if(idn_accepts(p[LX_IDN])) lex_type[i] = TT_IDENTIFIER;
+		else lex_type[i] = TT_UNKNOWN;
+		if(p[LX_FP] == FP_DIGITS) lex_flags[i] |= LXF_DOT_OK;
+		if(p[LX_SIGN]) lex_flags[i] |= LXF_SIGN_OK;
+		lex_flags[i] |= LXF_IDENT_RUN;
+		for(cc = CC_ZERO; cc <= CC_ALPHA; ++cc)
+			if(lex_next[i][cc] != i) lex_flags[i] &= ~LXF_IDENT_RUN;
 	}
-	return 1;
 }
 
-static enum tokentype categorize(const char *s) {
-	if(is_hex_int_literal(s)) return TT_HEX_INT_LIT;
-	if(is_dec_int_literal(s)) return TT_DEC_INT_LIT;
-	if(is_oct_int_literal(s)) return TT_OCT_INT_LIT;
-	if(is_float_literal(s)) return TT_FLOAT_LIT;
-	if(is_identifier(s)) return TT_IDENTIFIER;
-	return TT_UNKNOWN;
+static int lex_step(int s, int c) {
+	return lex_next[s][char_class[(unsigned char) c]];
 }
 
+static int is_plus_or_minus(int c) {
+	return c == '-' || c == '+';
+}
 
 static int is_sep(int c) {
 	static const char ascmap[128] = {
@@ -248,33 +521,120 @@ static int is_sep(int c) {
 	return !(c&128) && ascmap[c];
 }
 
-static int apply_coords(struct tokenizer *t, struct token* out, char *end, int retval) {
-	out->line = t->line;
-	uintptr_t len = end - t->buf;
-	out->column = t->column - len;
-	if(len + 1 >= t->bufsize) {
-		out->type = TT_OVERFLOW;
-		return 0;
-	}
-	return retval;
+static void tok_reserve(struct tokenizer *t, size_t size) {
+	if(size <= t->scratchsize) return;
+	t->scratchsize = t->scratchsize ? t->scratchsize * 2 : 256;
+	if(t->scratchsize < size) t->scratchsize = size;
+	t->scratch = realloc(t->scratch, t->scratchsize);
+}
+
+static void tok_begin(struct tokenizer *t) {
+	t->tokstart = t->cur;
+	t->toklen = 0;
+	t->spliced = 0;
 }
 
-static inline char *assign_bufchar(struct tokenizer *t, char *s, int c) {
-	t->column++;
-	*s = c;
-	return s + 1;
+static const char *tok_data(struct tokenizer *t) {
+	return t->spliced ? t->scratch : t->tokstart;
+}
+
+/* append c, the character just read, to the current token.
+   tokens are slices of the input window; only if a line continuation
+   or a comment interrupts them they get copied to the scratch buffer. */
+static void tok_addc(struct tokenizer *t, int c) {
+	if(!t->spliced) {
+		assert((unsigned char) t->cur[-1] == c);
+		if(!t->toklen) {
+			t->tokstart = t->cur - 1;
+			t->tokoff = tokenizer_ftello(t) - 1;
+		}
+		if(t->tokstart + t->toklen == t->cur - 1) {
+			t->toklen++;
+			return;
+		}
+		tok_reserve(t, t->toklen + 1);
+		memcpy(t->scratch, t->tokstart, t->toklen);
+		t->spliced = 1;
+	} else tok_reserve(t, t->toklen + 1);
+	t->scratch[t->toklen++] = c;
+}
+
+/* append the bytes between the cursor and p to the current token */
+static void tok_add_run(struct tokenizer *t, const char *p) {
+	size_t n = p - t->cur;
+	if(!n) return;
+	if(!t->spliced) {
+		if(!t->toklen) {
+			t->tokstart = t->cur;
+			t->tokoff = tokenizer_ftello(t);
+		}
+		if(t->tokstart + t->toklen == t->cur) {
+			t->toklen += n;
+			t->cur = p;
+			return;
+		}
+		tok_reserve(t, t->toklen + n);
+		memcpy(t->scratch, t->tokstart, t->toklen);
+		t->spliced = 1;
+	} else tok_reserve(t, t->toklen + n);
+	memcpy(t->scratch + t->toklen, t->cur, n);
+	t->toklen += n;
+	t->cur = p;
+}
+
+/* append everything up to the next a, b or c to the current token */
+static void tok_add_until3(struct tokenizer *t, int a, int b, int c) {
+	do tok_add_run(t, scan3(t->cur, t->end, a, b, c));
+	while(t->cur == t->end && tokenizer_refill(t));
+}
+
+/* append the following run of identifier characters to the current token */
+static void tok_add_ident(struct tokenizer *t) {
+	do tok_add_run(t, scan_ident(t->cur, t->end));
+	while(t->cur == t->end && tokenizer_refill(t));
+}
+
+/* append the following spaces and tabs to the current token, stopping
+   at any that could start a comment marker or custom token */
+static void tok_add_blanks(struct tokenizer *t) {
+	const char *p;
+	do {
+		for(p = t->cur; p < t->end && (*p == ' ' || *p == '\t') &&
+		    !LEAD_TEST(t->marker_lead, *p) && !LEAD_TEST(t->custom_lead, *p); ++p);
+		tok_add_run(t, p);
+	} while(t->cur == t->end && tokenizer_refill(t));
+}
+
+/* skip everything up to the next a, b or c, which mustn't be newlines */
+static void skip_until3(struct tokenizer *t, int a, int b, int c) {
+	do t->cur = scan3(t->cur, t->end, a, b, c);
+	while(t->cur == t->end && tokenizer_refill(t));
+}
+
+/* make the current token the len bytes just consumed */
+static void tok_set_consumed(struct tokenizer *t, size_t len) {
+	t->tokstart = t->cur - len;
+	t->tokoff = tokenizer_ftello(t) - len;
+	t->toklen = len;
+	t->spliced = 0;
+}
+
+static int apply_coords(struct tokenizer *t, struct token* out, int retval) {
+	out->offset = t->toklen ? t->tokoff : tokenizer_ftello(t);
+	out->line_start = out->offset == t->line_off;
+	out->str = tok_data(t);
+	out->len = t->toklen;
+	return retval;
 }
 
 static int get_string(struct tokenizer *t, char quote_char, struct token* out, int wide) {
-	char *s = t->buf+1;
 	int escaped = 0;
-	char *end = t->buf + t->bufsize - 2;
-	while(s < end) {
+	while(1) {
+		if(!escaped) tok_add_until3(t, quote_char, '\\', '\n');
 		int c = tokenizer_getc(t);
 		if(c == EOF) {
 			out->type = TT_EOF;
-			*s = 0;
-			return apply_coords(t, out, s, 0);
+			return apply_coords(t, out, 0);
 		}
 		if(c == '\\') {
 			c = tokenizer_getc(t);
@@ -289,29 +649,23 @@ static int get_string(struct tokenizer *t, char quote_char, struct token* out, i
 			}
 			tokenizer_ungetc(t, c);
 			out->type = TT_UNKNOWN;
-			s = assign_bufchar(t, s, 0);
-			return apply_coords(t, out, s, 0);
+			return apply_coords(t, out, 0);
 		}
 		if(!escaped) {
 			if(c == quote_char) {
-				s = assign_bufchar(t, s, c);
-				*s = 0;
-				//s = assign_bufchar(t, s, 0);
+				tok_addc(t, c);
 				if(!wide)
 					out->type = (quote_char == '"'? TT_DQSTRING_LIT : TT_SQSTRING_LIT);
 				else
 					out->type = (quote_char == '"'? TT_WIDESTRING_LIT : TT_WIDECHAR_LIT);
-				return apply_coords(t, out, s, 1);
+				return apply_coords(t, out, 1);
 			}
 			if(c == '\\') escaped = 1;
 		} else {
 			escaped = 0;
 		}
-		s = assign_bufchar(t, s, c);
+		tok_addc(t, c);
 	}
-	t->buf[MAX_TOK_LEN-1] = 0;
-	out->type = TT_OVERFLOW;
-	return apply_coords(t, out, s, 0);
 }
 
 /* if sequence found, next tokenizer call will point after the sequence */
@@ -332,7 +686,6 @@ static int sequence_follows(struct tokenizer *t, int c, const char *which)
 }
 
 int tokenizer_skip_chars(struct tokenizer *t, const char *chars, int *count) {
-	assert(!t->peeking);
 	int c;
 	*count = 0;
 	while(1) {
@@ -356,91 +709,509 @@ int tokenizer_skip_chars(struct tokenizer *t, const char *chars, int *count) {
 
 }
 
-int tokenizer_read_until(struct tokenizer *t, const char* marker, int stop_at_nl)
+int tokenizer_read_until(struct tokenizer *t, const char* marker, int stop_at_nl, struct token *out)
 {
-	int c, marker_is_nl = !strcmp(marker, "\n");
-	char *s = t->buf;
+	int c, ret = 1, marker_is_nl = !strcmp(marker, "\n");
+	tok_begin(t);
 	while(1) {
 		c = tokenizer_getc(t);
 		if(c == EOF) {
-			*s = 0;
-			return 0;
+			ret = 0;
+			goto done;
 		}
 		if(c == '\n') {
-			t->line++;
-			t->column = 0;
+			t->line_off = tokenizer_ftello(t);
 			if(stop_at_nl) {
-				*s = 0;
-				if(marker_is_nl) return 1;
-				return 0;
+				ret = marker_is_nl;
+				goto done;
 			}
 		}
 		if(!sequence_follows(t, c, marker))
-			s = assign_bufchar(t, s, c);
+			tok_addc(t, c);
 		else
 			break;
 	}
-	*s = 0;
 	size_t i;
 	for(i=strlen(marker); i > 0; )
 		tokenizer_ungetc(t, marker[--i]);
+done:
+	out->str = tok_data(t);
+	out->len = t->toklen;
+	return ret;
+}
+static int ignore_until(struct tokenizer *t, const char* marker);
+
+/* read the rest of the logical line as is, up to and including the
+   newline that isn't escaped with a backslash, without lexing it.
+   comments are dropped, the same way the lexer would drop them, and
+   string and character literals are skipped so that nothing in them
+   is taken for a comment or the end of the line. */
+int tokenizer_read_line(struct tokenizer *t, struct token *out)
+{
+	int c, quote = 0, escaped = 0;
+	tok_begin(t);
+	while((c = tokenizer_getc(t)) != EOF) {
+		if(!quote && LEAD_TEST(t->marker_lead, c)) {
+			if(sequence_follows(t, c, t->marker[MT_MULTILINE_COMMENT_START])) {
+				ignore_until(t, t->marker[MT_MULTILINE_COMMENT_END]);
+				continue;
+			}
+			if(sequence_follows(t, c, t->marker[MT_SINGLELINE_COMMENT_START])) {
+				ignore_until(t, "\n");
+				continue;
+			}
+		}
+		tok_addc(t, c);
+		if(c == '\\') {
+			c = tokenizer_getc(t);
+			if(c == '\n') {
+				tok_addc(t, c);
+				continue;
+			}
+			if(c != EOF) tokenizer_ungetc(t, c);
+			c = '\\';
+		}
+		if(c == '\n') {
+			if(quote && escaped) {
+				escaped = 0;
+				continue;
+			}
+			t->line_off = tokenizer_ftello(t);
+			break;
+		}
+		if(!quote) {
+			if(c == '"' || c == '\'') quote = c;
+		} else if(escaped) {
+			escaped = 0;
+		} else if(c == quote) {
+			quote = 0;
+		} else if(c == '\\') {
+			escaped = 1;
+		}
+	}
+	out->type = TT_UNKNOWN;
+	out->offset = t->toklen ? t->tokoff : tokenizer_ftello(t);
+	out->line_start = 0;
+	out->str = tok_data(t);
+	out->len = t->toklen;
 	return 1;
 }
-static int ignore_until(struct tokenizer *t, const char* marker, int col_advance)
+
+static int ignore_until(struct tokenizer *t, const char* marker)
 {
-	t->column += col_advance;
-	int c;
+	int c, first = marker && marker[0] ? (unsigned char) marker[0] : '\n';
 	do {
+		skip_until3(t, first, '\n', '\n');
 		c = tokenizer_getc(t);
 		if(c == EOF) return 0;
-		if(c == '\n') {
-			t->line++;
-			t->column = 0;
-		} else t->column++;
+		if(c == '\n') t->line_off = tokenizer_ftello(t);
 	} while(!sequence_follows(t, c, marker));
-	t->column += strlen(marker)-1;
 	return 1;
 }
 
-void tokenizer_skip_until(struct tokenizer *t, const char *marker)
+/* NUL-terminated copy of tok's spelling, valid until the next token
+   is read from t. */
+const char *tokenizer_tokstr(struct tokenizer *t, const struct token *tok) {
+	if(tok->str != t->scratch) {
+		tok_reserve(t, tok->len + 1);
+		memcpy(t->scratch, tok->str, tok->len);
+	} else
+		tok_reserve(t, tok->len + 1);
+	t->scratch[tok->len] = 0;
+	return t->scratch;
+}
+
+/* move the cursor forward to off, the start of a line. returns 0 if
+   the input ends before. */
+int tokenizer_seek(struct tokenizer *t, off_t off)
 {
-	ignore_until(t, marker, 0);
+	assert(off >= tokenizer_ftello(t));
+	while(off > t->src_off + (t->end - t->src)) {
+		t->cur = t->end;
+		if(!tokenizer_refill(t)) return 0;
+	}
+	t->cur = t->src + (off - t->src_off);
+	t->line_off = off;
+	return 1;
+}
+
+/* whether one of words, or any if words is 0, follows at p after
+   blanks. if that can't be ruled out by looking at the window, e.g.
+   as a comment or a continuation may interrupt the word, it's assumed
+   to. */
+static int word_follows(struct tokenizer *t, const char *p, const char *const *words) {
+	const char *e;
+	if(!words) return 1;
+	while(p < t->end && (*p == ' ' || *p == '\t')) ++p;
+	e = scan_ident(p, t->end);
+	if(e == p || e == t->end || *e == '\\' || LEAD_TEST(t->marker_lead, (unsigned char) *e))
+		return 1;
+	for(; *words; ++words)
+		if(strlen(*words) == (size_t) (e - p) && !memcmp(*words, p, e - p)) return 1;
+	return 0;
+}
+
+/* skip lines up to the next one whose first character other than
+   blanks is lead, followed by one of words (any, if words is 0), and
+   leave the cursor at the start of that line, or at lead if the window
+   moved past it. unless the cursor is at the start of a line, the rest
+   of the current one is skipped first. nothing is
+   lexed, only comments, string literals and line continuations are
+   followed, so a lead in them doesn't count. returns 0 at the end of
+   the input. */
+int tokenizer_skip_lines(struct tokenizer *t, int lead, const char *const *words)
+{
+	uint32_t stop[8];
+	int c, q, bol = tokenizer_ftello(t) == t->line_off;
+	memcpy(stop, t->marker_lead, sizeof stop);
+	LEAD_SET(stop, '\n');
+	LEAD_SET(stop, '\\');
+	if(t->flags & TF_PARSE_STRINGS) {
+		LEAD_SET(stop, '"');
+		LEAD_SET(stop, '\'');
+	}
+	while(1) {
+		if(bol) {
+			off_t start = tokenizer_ftello(t);
+			do c = tokenizer_getc(t);
+			while(c == ' ' || c == '\t');
+			if(c == EOF) return 0;
+			tokenizer_ungetc(t, c);
+			if(c == lead && word_follows(t, t->cur + 1, words)) {
+				if(start >= t->src_off) t->cur = t->src + (start - t->src_off);
+				t->line_off = tokenizer_ftello(t);
+				return 1;
+			}
+			bol = 0;
+		}
+		do {
+			const char *p = t->cur;
+			while(p < t->end && !LEAD_TEST(stop, (unsigned char) *p)) ++p;
+			t->cur = p;
+		} while(t->cur == t->end && tokenizer_refill(t));
+		switch((c = tokenizer_getc(t))) {
+		case EOF:
+			return 0;
+		case '\n':
+			t->line_off = tokenizer_ftello(t);
+			bol = 1;
+			break;
+		case '\\':
+			c = tokenizer_getc(t);
+			if(c != EOF && c != '\n') tokenizer_ungetc(t, c);
+			break;
+		case '"': case '\'':
+			for(q = c; ; ) {
+				skip_until3(t, q, '\\', '\n');
+				c = tokenizer_getc(t);
+				if(c == '\\') c = tokenizer_getc(t);
+				else if(c == q) break;
+				else if(c == '\n') {
+					t->line_off = tokenizer_ftello(t);
+					bol = 1;
+					break;
+				}
+				if(c == EOF) return 0;
+			}
+			break;
+		default:
+			if(sequence_follows(t, c, t->marker[MT_MULTILINE_COMMENT_START])) {
+				if(!ignore_until(t, t->marker[MT_MULTILINE_COMMENT_END])) return 0;
+			} else if(sequence_follows(t, c, t->marker[MT_SINGLELINE_COMMENT_START])) {
+				if(!ignore_until(t, "\n")) return 0;
+				bol = 1;
+			}
+		}
+	}
+}
+
+/* lexing ahead on worker threads.
+   the rest of a mapped input is split into chunks starting after a
+   newline, which the workers lex with private copies of the tokenizer.
+   as a chunk may actually start inside a comment or string, a token
+   lexed ahead is only handed out if the tokenizer is in exactly the
+   state the worker read it in - same position, line start and flags.
+   anything else is lexed live until both streams meet again. */
+struct prelexed {
+	off_t offset, end, line_off;
+	const char *str;
+	size_t len;
+	int type, value;
+	unsigned char ret, line_start, spliced;
+};
+
+enum { CK_FREE = 0, CK_BUSY, CK_DONE };
+
+struct prelex_chunk {
+	int state;
+	/* tokens read starting in [start, end), the first with line_off */
+	off_t start, end, line_off;
+	struct prelexed *toks;
+	size_t count, alloc;
+	/* spellings of tokens that didn't fit in the window */
+	char *arena;
+	size_t arena_len, arena_alloc;
+};
+
+struct prelex {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t *threads;
+	size_t nthreads;
+	int stop;
+	struct tokenizer proto;
+	off_t first, limit;
+	size_t nchunks, next;
+	/* chunk k is kept in slots[k % nslots] until it has been consumed */
+	struct prelex_chunk *slots;
+	size_t nslots;
+	/* reader side: current chunk, whether it's done and the next token */
+	size_t consume, pos;
+	int ready;
+};
+
+static off_t prelex_boundary(struct prelex *pl, size_t k) {
+	if(k == 0) return pl->first;
+	off_t n = pl->first + (off_t) k * TOKENIZER_PRELEX_CHUNK;
+	if(n >= pl->limit) return pl->limit;
+	const char *p = memchr(pl->proto.src + n - 1, '\n', pl->limit - n + 1);
+	return p ? p + 1 - pl->proto.src : pl->limit;
+}
+
+static int prelex_add(struct prelex_chunk *ck, struct tokenizer *t, const struct token *tok, int ret) {
+	if(ck->count == ck->alloc) {
+		size_t n = ck->alloc ? ck->alloc * 2 : 4096;
+		struct prelexed *q = realloc(ck->toks, n * sizeof *q);
+		if(!q) return 0;
+		ck->toks = q;
+		ck->alloc = n;
+	}
+	struct prelexed *p = &ck->toks[ck->count];
+	*p = (struct prelexed) {
+		.offset = tok->offset, .end = tokenizer_ftello(t), .line_off = t->line_off,
+		.str = tok->str, .len = tok->len, .type = tok->type, .value = tok->value,
+		.ret = ret, .line_start = tok->line_start };
+	if(tok->str == t->scratch) {
+		if(ck->arena_len + tok->len > ck->arena_alloc) {
+			size_t n = ck->arena_alloc ? ck->arena_alloc : 4096;
+			while(n < ck->arena_len + tok->len) n *= 2;
+			char *q = realloc(ck->arena, n);
+			if(!q) return 0;
+			ck->arena = q;
+			ck->arena_alloc = n;
+		}
+		memcpy(ck->arena + ck->arena_len, tok->str, tok->len);
+		/* the arena may still move, so keep the offset for now */
+		p->str = (const char *) (uintptr_t) ck->arena_len;
+		p->spliced = 1;
+		ck->arena_len += tok->len;
+	}
+	ck->count++;
+	return 1;
+}
+
+static void prelex_chunk(struct tokenizer *t, struct prelex_chunk *ck) {
+	size_t i;
+	t->cur = t->src + ck->start;
+	t->line_off = ck->line_off;
+	while(tokenizer_ftello(t) < ck->end) {
+		struct token tok;
+		int ret = tokenizer_next(t, &tok);
+		if(tok.type == TT_EOF || !prelex_add(ck, t, &tok, ret)) break;
+	}
+	for(i = 0; i < ck->count; ++i)
+		if(ck->toks[i].spliced)
+			ck->toks[i].str = ck->arena + (uintptr_t) ck->toks[i].str;
+}
+
+static void *prelex_worker(void *arg) {
+	struct prelex *pl = arg;
+	struct tokenizer t = pl->proto;
+	pthread_mutex_lock(&pl->lock);
+	while(!pl->stop) {
+		if(pl->next < pl->nchunks && pl->next < pl->consume + pl->nslots) {
+			size_t k = pl->next++;
+			struct prelex_chunk *ck = &pl->slots[k % pl->nslots];
+			ck->state = CK_BUSY;
+			pthread_mutex_unlock(&pl->lock);
+			ck->start = prelex_boundary(pl, k);
+			ck->end = prelex_boundary(pl, k + 1);
+			ck->line_off = k ? ck->start : pl->proto.line_off;
+			prelex_chunk(&t, ck);
+			pthread_mutex_lock(&pl->lock);
+			ck->state = CK_DONE;
+			pthread_cond_broadcast(&pl->cond);
+		} else
+			pthread_cond_wait(&pl->cond, &pl->lock);
+	}
+	pthread_mutex_unlock(&pl->lock);
+	tokenizer_fini(&t);
+	return 0;
+}
+
+static void prelex_stop(struct tokenizer *t) {
+	struct prelex *pl = t->prelex;
+	size_t i;
+	if(!pl) return;
+	pthread_mutex_lock(&pl->lock);
+	pl->stop = 1;
+	pthread_cond_broadcast(&pl->cond);
+	pthread_mutex_unlock(&pl->lock);
+	for(i = 0; i < pl->nthreads; ++i)
+		pthread_join(pl->threads[i], 0);
+	for(i = 0; i < pl->nslots; ++i) {
+		free(pl->slots[i].toks);
+		free(pl->slots[i].arena);
+	}
+	pthread_cond_destroy(&pl->cond);
+	pthread_mutex_destroy(&pl->lock);
+	free(pl->slots);
+	free(pl->threads);
+	free(pl);
+	t->prelex = 0;
+}
+
+/* start lexing the rest of the input ahead on nthreads threads.
+   only done for mapped inputs of at least TOKENIZER_PRELEX_MIN bytes,
+   returns whether it was started. */
+int tokenizer_prelex(struct tokenizer *t, int nthreads) {
+	if(t->backend != TB_MMAP || t->prelex || nthreads < 1) return 0;
+	off_t first = tokenizer_ftello(t), limit = t->end - t->src;
+	if(limit - first < TOKENIZER_PRELEX_MIN) return 0;
+	struct prelex *pl = calloc(1, sizeof *pl);
+	if(!pl) return 0;
+	pl->nslots = 2 * nthreads;
+	pl->slots = calloc(pl->nslots, sizeof *pl->slots);
+	pl->threads = calloc(nthreads, sizeof *pl->threads);
+	pl->first = first;
+	pl->limit = limit;
+	pl->nchunks = (limit - first + TOKENIZER_PRELEX_CHUNK - 1) / TOKENIZER_PRELEX_CHUNK;
+	pl->proto = *t;
+	pl->proto.backend = TB_NONE;
+	pl->proto.blk = pl->proto.scratch = 0;
+	pl->proto.blksize = pl->proto.scratchsize = 0;
+	pl->proto.nl_offs = 0;
+	pl->proto.nl_count = pl->proto.nl_alloc = 0;
+	pl->proto.prelex = 0;
+	pthread_mutex_init(&pl->lock, 0);
+	pthread_cond_init(&pl->cond, 0);
+	t->prelex = pl;
+	if(pl->slots && pl->threads)
+		for(; pl->nthreads < (size_t) nthreads; ++pl->nthreads)
+			if(pthread_create(&pl->threads[pl->nthreads], 0, prelex_worker, pl)) break;
+	if(!pl->nthreads) {
+		prelex_stop(t);
+		return 0;
+	}
+	return 1;
+}
+
+/* hand out the token lexed ahead at the current position.
+   returns -1 if there is none and it has to be lexed live. */
+static int prelex_next(struct tokenizer *t, struct token *out) {
+	struct prelex *pl = t->prelex;
+	struct prelex_chunk *ck;
+	off_t pos = tokenizer_ftello(t);
+	if(t->flags != pl->proto.flags || pos < pl->first) return -1;
+	while(1) {
+		if(pl->consume == pl->nchunks) return -1;
+		ck = &pl->slots[pl->consume % pl->nslots];
+		if(!pl->ready) {
+			pthread_mutex_lock(&pl->lock);
+			while(ck->state != CK_DONE)
+				pthread_cond_wait(&pl->cond, &pl->lock);
+			pthread_mutex_unlock(&pl->lock);
+			pl->ready = 1;
+		}
+		if(pos < ck->end) break;
+		pthread_mutex_lock(&pl->lock);
+		ck->state = CK_FREE;
+		ck->count = ck->arena_len = 0;
+		pl->consume++;
+		pthread_cond_broadcast(&pl->cond);
+		pthread_mutex_unlock(&pl->lock);
+		pl->pos = 0;
+		pl->ready = 0;
+	}
+	off_t start = ck->start;
+	while(pl->pos < ck->count && (start = pl->pos ? ck->toks[pl->pos - 1].end : ck->start) < pos)
+		pl->pos++;
+	if(pl->pos == ck->count || start != pos) return -1;
+	if(t->line_off != (pl->pos ? ck->toks[pl->pos - 1].line_off : ck->line_off)) return -1;
+	const struct prelexed *p = &ck->toks[pl->pos++];
+	*out = (struct token) {
+		.type = p->type, .offset = p->offset, .line_start = p->line_start,
+		.value = p->value, .str = p->str, .len = p->len };
+	t->cur = t->src + p->end;
+	t->line_off = p->line_off;
+	return p->ret;
+}
+
+/* multiply two 64 bit words into 128 bits, and fold the halves */
+static uint64_t hash_mix(uint64_t a, uint64_t b) {
+#ifdef __SIZEOF_INT128__
+	__uint128_t r = (__uint128_t) a * b;
+	return (uint64_t) r ^ (uint64_t) (r >> 64);
+#else
+	uint64_t r = a * b;
+	return r ^ (r >> 32) ^ (a >> 29) * (b | 1);
+#endif
+}
+
+/* string hash in the manner of wyhash: the input is consumed 8 bytes
+   at a time, each word mixed in with a full-width multiply. */
+unsigned tokenizer_hash(const char *s, size_t len) {
+	uint64_t h = 0x2d358dccaa6c78a5ull ^ len, w;
+	for(; len >= 8; s += 8, len -= 8) {
+		memcpy(&w, s, 8);
+		h = hash_mix(h ^ w, 0x8bb84b93962eacc9ull);
+	}
+	w = 0;
+	memcpy(&w, s, len);
+	h = hash_mix(h ^ w, 0x4b33a62ed433d4a3ull);
+	h = hash_mix(h, 0x9e3779b97f4a7c15ull);
+	return (unsigned) (h ^ (h >> 32));
 }
 
 int tokenizer_next(struct tokenizer *t, struct token* out) {
-	char *s = t->buf;
 	out->value = 0;
 	int c = 0;
-	if(t->peeking) {
-		*out = t->peek_token;
-		t->peeking = 0;
-		return 1;
+	if(t->prelex) {
+		int ret = prelex_next(t, out);
+		if(ret != -1) return ret;
 	}
+	/* runs of identifier characters can be consumed in one go,
+	   unless a comment marker could start inside of them. */
+	int ident_runs = !t->ident_markers;
+	int state = 0;
+	tok_begin(t);
 	while(1) {
 		c = tokenizer_getc(t);
 		if(c == EOF) break;
 
 		/* components of multi-line comment marker might be terminals themselves */
-		if(sequence_follows(t, c, t->marker[MT_MULTILINE_COMMENT_START])) {
-			ignore_until(t, t->marker[MT_MULTILINE_COMMENT_END], strlen(t->marker[MT_MULTILINE_COMMENT_START]));
-			continue;
-		}
-		if(sequence_follows(t, c, t->marker[MT_SINGLELINE_COMMENT_START])) {
-			ignore_until(t, "\n", strlen(t->marker[MT_SINGLELINE_COMMENT_START]));
-			continue;
+		if(LEAD_TEST(t->marker_lead, c)) {
+			if(sequence_follows(t, c, t->marker[MT_MULTILINE_COMMENT_START])) {
+				ignore_until(t, t->marker[MT_MULTILINE_COMMENT_END]);
+				continue;
+			}
+			if(sequence_follows(t, c, t->marker[MT_SINGLELINE_COMMENT_START])) {
+				ignore_until(t, "\n");
+				continue;
+			}
 		}
 		if(is_sep(c)) {
-			if(s != t->buf && c == '\\' && !isspace(s[-1])) {
+			const char *s = tok_data(t) + t->toklen;
+			if(t->toklen && c == '\\' && !isspace(s[-1])) {
 				c = tokenizer_getc(t);
 				if(c == '\n') continue;
 				tokenizer_ungetc(t, c);
 				c = '\\';
-			} else if(is_plus_or_minus(c) && s > t->buf+1 &&
-				  (s[-1] == 'E' || s[-1] == 'e') && is_valid_float_until(t->buf, s-1)) {
+			} else if(is_plus_or_minus(c) && (lex_flags[state] & LXF_SIGN_OK)) {
 				goto process_char;
-			} else if(c == '.' && s != t->buf && is_valid_float_until(t->buf, s) == 1) {
+			} else if(c == '.' && (lex_flags[state] & LXF_DOT_OK)) {
 				goto process_char;
-			} else if(c == '.' && s == t->buf) {
+			} else if(c == '.' && !t->toklen) {
 				int jump = 0;
 				c = tokenizer_getc(t);
 				if(isdigit(c)) jump = 1;
@@ -451,24 +1222,26 @@ int tokenizer_next(struct tokenizer *t, struct token* out) {
 			tokenizer_ungetc(t, c);
 			break;
 		}
-		if((t->flags & TF_PARSE_WIDE_STRINGS) && s == t->buf && c == 'L') {
+		if((t->flags & TF_PARSE_WIDE_STRINGS) && !t->toklen && c == 'L') {
 			c = tokenizer_getc(t);
-			tokenizer_ungetc(t, c);
-			tokenizer_ungetc(t, 'L');
-			if(c == '\'' || c == '\"') break;
+			if(c != EOF) tokenizer_ungetc(t, c);
+			if(c == '\'' || c == '\"') {
+				tokenizer_ungetc(t, 'L');
+				break;
+			}
+			c = 'L';
 		}
 
 process_char:;
-		s = assign_bufchar(t, s, c);
-		if(t->column + 1 >= MAX_TOK_LEN) {
-			out->type = TT_OVERFLOW;
-			return apply_coords(t, out, s, 0);
-		}
+		tok_addc(t, c);
+		state = lex_step(state, c);
+		if(ident_runs && is_ident_char(c) && (lex_flags[state] & LXF_IDENT_RUN))
+			tok_add_ident(t);
 	}
-	if(s == t->buf) {
+	if(!t->toklen) {
 		if(c == EOF) {
 			out->type = TT_EOF;
-			return apply_coords(t, out, s, 1);
+			return apply_coords(t, out, 1);
 		}
 
 		int wide = 0;
@@ -479,46 +1252,40 @@ process_char:;
 			wide = 1;
 			goto string_handling;
 		} else if (c == '.' && sequence_follows(t, c, "...")) {
-			strcpy(t->buf, "...");
+			tok_set_consumed(t, 3);
 			out->type = TT_ELLIPSIS;
-			return apply_coords(t, out, s+3, 1);
+			return apply_coords(t, out, 1);
 		}
 
-		{
+		if(LEAD_TEST(t->custom_lead, c)) {
 			int i;
-			for(i = 0; i < t->custom_count; i++)
+			for(i = t->custom_head[c] - 1; i >= 0; i = t->custom_next[i] - 1)
 				if(sequence_follows(t, c, t->custom_tokens[i])) {
-					const char *p = t->custom_tokens[i];
-					while(*p) {
-						s = assign_bufchar(t, s, *p);
-						p++;
-					}
-					*s = 0;
+					size_t len = strlen(t->custom_tokens[i]);
+					tok_set_consumed(t, len);
 					out->type = TT_CUSTOM + i;
-					return apply_coords(t, out, s, 1);
+					return apply_coords(t, out, 1);
 				}
 		}
 
 string_handling:
-		s = assign_bufchar(t, s, c);
-		*s = 0;
-		//s = assign_bufchar(t, s, 0);
+		tok_addc(t, c);
 		if(c == '"' || c == '\'')
 			if(t->flags & TF_PARSE_STRINGS) return get_string(t, c, out, wide);
 		out->type = TT_SEP;
 		out->value = c;
 		if(c == '\n') {
-			apply_coords(t, out, s, 1);
-			t->line++;
-			t->column=0;
+			apply_coords(t, out, 1);
+			t->line_off = tokenizer_ftello(t);
 			return 1;
 		}
-		return apply_coords(t, out, s, 1);
+		if((c == ' ' || c == '\t') && (t->flags & TF_WHITESPACE_RUNS))
+			tok_add_blanks(t);
+		return apply_coords(t, out, 1);
 	}
-	//s = assign_bufchar(t, s, 0);
-	*s = 0;
-	out->type = categorize(t->buf);
-	return apply_coords(t, out, s, out->type != TT_UNKNOWN);
+	out->type = lex_type[state];
+	if(out->type == TT_IDENTIFIER) out->value = tokenizer_hash(tok_data(t), t->toklen);
+	return apply_coords(t, out, out->type != TT_UNKNOWN);
 }
 
 void tokenizer_set_flags(struct tokenizer *t, int flags) {
@@ -529,20 +1296,89 @@ int tokenizer_get_flags(struct tokenizer *t) {
 	return t->flags;
 }
 
+static void tokenizer_reset(struct tokenizer *t) {
+	t->line_off = 0;
+}
+
 void tokenizer_init(struct tokenizer *t, FILE* in, int flags) {
-	*t = (struct tokenizer){ .input = in, .line = 1, .flags = flags, .bufsize = MAX_TOK_LEN};
+	scan_init();
+	lex_dfa_init();
+	*t = (struct tokenizer){ .input = in, .flags = flags, .fd = -1};
+	t->src = t->cur = t->end = "";
+	int fd = fileno(in);
+	struct stat st;
+	if(fd != -1 && !fstat(fd, &st) && S_ISREG(st.st_mode)) {
+		off_t pos = ftello(in);
+		void *p = st.st_size > 0 ? mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+		if(p != MAP_FAILED && pos >= 0 && pos <= st.st_size) {
+			t->backend = TB_MMAP;
+			t->src = p;
+			t->end = t->src + st.st_size;
+			t->cur = t->src + pos;
+			t->line_off = pos;
+			return;
+		}
+		if(p != MAP_FAILED) munmap(p, st.st_size);
+	}
+	/* pipes, ttys and memory streams are read block-wise.
+	   we only use read() on the descriptor if stdio has nothing
+	   buffered yet, which is the case for freshly opened streams. */
+	t->backend = TB_BLOCK;
+	if(fd != -1 && ftello(in) <= 0) t->fd = fd;
+}
+
+/* tokenize len bytes at buf, which must stay valid as long as t is used */
+void tokenizer_init_buffer(struct tokenizer *t, const char *buf, size_t len, int flags) {
+	scan_init();
+	lex_dfa_init();
+	*t = (struct tokenizer){ .flags = flags, .fd = -1, .backend = TB_BUFFER };
+	t->src = t->cur = buf;
+	t->end = buf + len;
+	t->input_eof = 1;
+}
+
+void tokenizer_fini(struct tokenizer *t) {
+	prelex_stop(t);
+	if(t->backend == TB_MMAP)
+		munmap((void*) t->src, t->end - t->src);
+	free(t->blk);
+	free(t->scratch);
+	free(t->nl_offs);
+	t->blk = 0;
+	t->scratch = 0;
+	t->nl_offs = 0;
+	t->nl_count = t->nl_alloc = 0;
+	t->nl_upto = 0;
+	t->backend = TB_NONE;
 }
 
 void tokenizer_register_marker(struct tokenizer *t, enum markertype mt, const char* marker)
 {
+	prelex_stop(t);
 	t->marker[mt] = marker;
+	/* only the start markers are looked for in regular input */
+	memset(t->marker_lead, 0, sizeof t->marker_lead);
+	t->ident_markers = 0;
+	static const enum markertype start[] = {MT_SINGLELINE_COMMENT_START, MT_MULTILINE_COMMENT_START};
+	size_t i;
+	for(i = 0; i < ARRAY_SIZE(start); ++i) {
+		const char *p = t->marker[start[i]];
+		if(!p || !p[0]) continue;
+		LEAD_SET(t->marker_lead, (unsigned char) p[0]);
+		if(is_ident_char((unsigned char) p[0])) t->ident_markers = 1;
+	}
 }
 
 int tokenizer_rewind(struct tokenizer *t) {
-	FILE *f = t->input;
-	int flags = t->flags;
-	const char* fn = t->filename;
-	tokenizer_init(t, f, flags);
-	tokenizer_set_filename(t, fn);
-	return fseek(f, 0, SEEK_SET) == 0;
+	prelex_stop(t);
+	tokenizer_reset(t);
+	if(t->backend == TB_MMAP || t->backend == TB_BUFFER) {
+		t->cur = t->src;
+		return 1;
+	}
+	t->src_off = 0;
+	t->input_eof = 0;
+	t->src = t->cur = t->end = t->blk ? t->blk : "";
+	if(t->fd != -1) return lseek(t->fd, 0, SEEK_SET) == 0;
+	return fseek(t->input, 0, SEEK_SET) == 0;
 }
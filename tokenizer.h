@@ -1,16 +1,26 @@
 #ifndef TOKENIZER_H
 #define TOKENIZER_H
 
-#define MAX_TOK_LEN 4096
 #define MAX_UNGETC 8
+/* size of the refillable input block used for pipes and other
+   streams that can't be mmap()ed. */
+#define TOKENIZER_BLOCK_SIZE (64*1024)
+#define TOKENIZER_STREAM_BLOCK_SIZE 1024
+/* mapped inputs of at least TOKENIZER_PRELEX_MIN bytes can be lexed
+   ahead on worker threads, in chunks of TOKENIZER_PRELEX_CHUNK bytes. */
+#define TOKENIZER_PRELEX_MIN (4*1024*1024)
+#define TOKENIZER_PRELEX_CHUNK (256*1024)
 
 #include <stdint.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <sys/types.h>
 
-struct tokenizer_getc_buf {
-	int buf[MAX_UNGETC];
-	size_t cnt, buffered;
+enum tokenizer_backend {
+	TB_NONE = 0,
+	TB_MMAP,  /* entire regular file mapped into memory */
+	TB_BLOCK, /* refillable block read from fd or FILE */
+	TB_BUFFER, /* caller-owned memory */
 };
 
 enum markertype {
@@ -34,7 +44,6 @@ enum tokentype {
 	TT_SEP,
 	/* errors and similar */
 	TT_UNKNOWN,
-	TT_OVERFLOW,
 	TT_WIDECHAR_LIT,
 	TT_WIDESTRING_LIT,
 	TT_EOF,
@@ -45,51 +54,101 @@ const char* tokentype_to_str(enum tokentype tt);
 
 struct token {
 	enum tokentype type;
-	uint32_t line;
-	uint32_t column;
+	/* file offset of the token's first byte, see tokenizer_locate() */
+	off_t offset;
+	/* set if the token is the first one of a line */
+	int line_start;
+	/* the character of a TT_SEP, the tokenizer_hash() of an identifier */
 	int value;
+	/* spelling of the token. points into the tokenizer's input window
+	   (or its scratch buffer) and is not NUL-terminated. it stays valid
+	   until the next token is read from the same tokenizer. */
+	const char *str;
+	size_t len;
 };
 
 enum tokenizer_flags {
 	TF_PARSE_STRINGS = 1 << 0,
 	TF_PARSE_WIDE_STRINGS = 1 << 1,
+	/* return a run of spaces and tabs as a single TT_SEP token, whose
+	   value is its first character and str/len its exact spelling */
+	TF_WHITESPACE_RUNS = 1 << 2,
 };
 
+struct prelex;
+
 struct tokenizer {
 	FILE *input;
-	uint32_t line;
-	uint32_t column;
+	/* input window: bytes [src, end) correspond to file offsets
+	   [src_off, src_off + (end - src)). cur is the read cursor. */
+	const char *src;
+	const char *cur;
+	const char *end;
+	off_t src_off;
+	char *blk;
+	size_t blksize;
+	int fd;
+	int backend;
+	int input_eof;
+	/* offset where the current line started */
+	off_t line_off;
+	/* offsets of all newlines before nl_upto. built on demand from the
+	   mapped file, or for block-wise input as the window moves on. */
+	off_t *nl_offs;
+	size_t nl_count;
+	size_t nl_alloc;
+	off_t nl_upto;
 	int flags;
 	int custom_count;
-	int peeking;
 	const char *custom_tokens[MAX_CUSTOM_TOKENS];
-	char buf[MAX_TOK_LEN];
-	size_t bufsize;
-	struct tokenizer_getc_buf getc_buf;
+	/* dispatch tables, rebuilt on registration: bitmaps of the bytes
+	   that can start a comment marker or a custom token, and for each
+	   byte the chain of custom tokens (index + 1) starting with it,
+	   in the order they're tried. */
+	uint32_t marker_lead[8];
+	uint32_t custom_lead[8];
+	unsigned char custom_head[256];
+	unsigned char custom_next[MAX_CUSTOM_TOKENS];
+	int ident_markers;
+	/* token currently being read */
+	const char *tokstart;
+	off_t tokoff;
+	size_t toklen;
+	int spliced;
+	char *scratch;
+	size_t scratchsize;
 	const char* marker[MT_MAX+1];
 	const char* filename;
-	struct token peek_token;
+	struct prelex *prelex;
 };
 
 void tokenizer_init(struct tokenizer *t, FILE* in, int flags);
+void tokenizer_init_buffer(struct tokenizer *t, const char *buf, size_t len, int flags);
+void tokenizer_fini(struct tokenizer *t);
 void tokenizer_set_filename(struct tokenizer *t, const char*);
 void tokenizer_set_flags(struct tokenizer *t, int flags);
 int tokenizer_get_flags(struct tokenizer *t);
 off_t tokenizer_ftello(struct tokenizer *t);
+void tokenizer_locate(struct tokenizer *t, off_t offset, unsigned *line, unsigned *column);
 void tokenizer_register_marker(struct tokenizer*, enum markertype, const char*);
 void tokenizer_register_custom_token(struct tokenizer*, int tokentype, const char*);
 int tokenizer_next(struct tokenizer *t, struct token* out);
-int tokenizer_peek_token(struct tokenizer *t, struct token* out);
 int tokenizer_peek(struct tokenizer *t);
-void tokenizer_skip_until(struct tokenizer *t, const char *marker);
+int tokenizer_skip_lines(struct tokenizer *t, int lead, const char *const *words);
+int tokenizer_seek(struct tokenizer *t, off_t off);
 int tokenizer_skip_chars(struct tokenizer *t, const char *chars, int *count);
-int tokenizer_read_until(struct tokenizer *t, const char* marker, int stop_at_nl);
+int tokenizer_read_until(struct tokenizer *t, const char* marker, int stop_at_nl, struct token *out);
+int tokenizer_read_line(struct tokenizer *t, struct token *out);
+const char *tokenizer_tokstr(struct tokenizer *t, const struct token *tok);
 int tokenizer_rewind(struct tokenizer *t);
+int tokenizer_prelex(struct tokenizer *t, int nthreads);
+unsigned tokenizer_hash(const char *s, size_t len);
 
 #ifdef __GNUC__
 #pragma GCC diagnostic ignored "-Wunknown-pragmas"
 #endif
 #pragma RcB2 DEP "tokenizer.c"
+#pragma RcB2 LINK "-lpthread"
 
 #endif
 